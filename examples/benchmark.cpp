@@ -0,0 +1,318 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* Measures the cost of each PerfStubs entry point, in nanoseconds per call,
+ * for an increasing number of threads.  The same source is built without a
+ * tool, with a tool that does nothing and with the reference tool.
+ *
+ * Usage: benchmark [options]
+ *   -n <calls>    calls per batch (default 1000)
+ *   -b <batches>  batches per thread (default 200)
+ *   -t <threads>  maximum number of threads (default 4)
+ *   -o <file>     write the JSON results to a file instead of stdout
+ *   -c <file>     the results of the benchmark without a tool (from -o),
+ *                 whose medians are subtracted before checking the limits
+ *   -l <name>=<n> fail if the median cost of the named benchmark, less
+ *                 that of the same benchmark without a tool, exceeds n
+ *                 iterations of the empty loop (may be repeated, one
+ *                 limit per benchmark)
+ *   -s <factor>   multiply every limit by this (default 1)
+ *
+ * Each thread times batches of calls, and the percentiles are taken over
+ * the batches of all threads.  The limits are relative to the empty loop,
+ * measured in the same run on the same number of threads, so that they
+ * hold on slow machines; only the medians are checked, since the slowest
+ * batches depend on what else the machine is running. */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+#ifndef PS_BENCHMARK_TOOL
+#define PS_BENCHMARK_TOOL "unknown"
+#endif
+
+struct options {
+    size_t calls{1000};
+    size_t batches{200};
+    unsigned int threads{4};
+    const char * output{nullptr};
+    const char * baseline{nullptr};
+    std::vector<std::pair<std::string, double>> limits;
+    double scale{1.0};
+};
+
+struct result {
+    std::string benchmark;
+    unsigned int threads;
+    size_t calls;
+    double min;
+    double p50;
+    double p90;
+    double p99;
+};
+
+/* Keep the compiler from optimizing the loops away */
+std::atomic<uint64_t> sink{0};
+
+static inline uint64_t now(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void timer_start_stop(size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        PERFSTUBS_TIMER_START(_timer, "benchmark timer");
+        PERFSTUBS_TIMER_STOP(_timer);
+    }
+}
+
+void string_start_stop(size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        PERFSTUBS_START_STRING("benchmark string timer");
+        PERFSTUBS_STOP_STRING("benchmark string timer");
+    }
+}
+
+void counter_sample(size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        PERFSTUBS_SAMPLE_COUNTER("benchmark counter", (double)i);
+    }
+}
+
+void scoped_timer(size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        PERFSTUBS_SCOPED_TIMER("benchmark scoped timer");
+    }
+}
+
+/* The loop overhead alone, for reference */
+void empty_loop(size_t calls) {
+    uint64_t total = 0;
+    for (size_t i = 0 ; i < calls ; i++) {
+        total += i;
+        __asm__ __volatile__("" : "+r"(total));
+    }
+    sink += total;
+}
+
+struct benchmark {
+    const char * name;
+    void (*function)(size_t);
+};
+
+const benchmark benchmarks[] = {
+    {"empty_loop", empty_loop},
+    {"timer_start_stop", timer_start_stop},
+    {"string_start_stop", string_start_stop},
+    {"counter_sample", counter_sample},
+    {"scoped_timer", scoped_timer}
+};
+
+/* Run one benchmark on n threads, and return the nanoseconds per call of
+ * every batch */
+std::vector<double> run(const benchmark& b, unsigned int n,
+    const options& opts) {
+    std::vector<double> samples(opts.batches * n);
+    std::atomic<unsigned int> ready{0};
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0 ; t < n ; t++) {
+        threads.push_back(std::thread([&, t]() {
+            PERFSTUBS_REGISTER_THREAD();
+            /* warm up, and create the timers */
+            b.function(opts.calls);
+            ready++;
+            while (ready.load() < n) {
+                std::this_thread::yield();
+            }
+            for (size_t i = 0 ; i < opts.batches ; i++) {
+                uint64_t start = now();
+                b.function(opts.calls);
+                uint64_t end = now();
+                samples[t * opts.batches + i] =
+                    (double)(end - start) / (double)opts.calls;
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return samples;
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void write_json(FILE * out, const std::vector<result>& results,
+    const options& opts) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"tool\": \"%s\",\n", PS_BENCHMARK_TOOL);
+    fprintf(out, "  \"calls_per_batch\": %zu,\n", opts.calls);
+    fprintf(out, "  \"batches_per_thread\": %zu,\n", opts.batches);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0 ; i < results.size() ; i++) {
+        const result& r = results[i];
+        fprintf(out, "    {\"benchmark\": \"%s\", \"threads\": %u, "
+            "\"calls\": %zu, \"ns_per_call\": {\"min\": %.3f, "
+            "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}}%s\n",
+            r.benchmark.c_str(), r.threads, r.calls, r.min, r.p50, r.p90,
+            r.p99, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/* Read the results written by a previous run */
+bool read_results(const char * file, std::vector<result>& results) {
+    FILE * in = fopen(file, "r");
+    if (in == nullptr) {
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), in) != nullptr) {
+        char name[64];
+        result r;
+        if (sscanf(line, " {\"benchmark\": \"%63[^\"]\", \"threads\": %u, "
+            "\"calls\": %zu, \"ns_per_call\": {\"min\": %lf, "
+            "\"p50\": %lf, \"p90\": %lf, \"p99\": %lf", name, &r.threads,
+            &r.calls, &r.min, &r.p50, &r.p90, &r.p99) == 7) {
+            r.benchmark = name;
+            results.push_back(r);
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+const result * find(const std::vector<result>& results,
+    const std::string& benchmark, unsigned int threads) {
+    for (const auto& r : results) {
+        if (r.benchmark == benchmark && r.threads == threads) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+    for (int i = 1 ; i + 1 < argc ; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            opts.calls = strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            opts.batches = strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            opts.threads = strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            opts.output = argv[i+1];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            opts.baseline = argv[i+1];
+        } else if (strcmp(argv[i], "-l") == 0) {
+            const char * equals = strchr(argv[i+1], '=');
+            if (equals == nullptr || strtod(equals + 1, nullptr) <= 0.0) {
+                fprintf(stderr, "Invalid limit %s\n", argv[i+1]);
+                return 1;
+            }
+            opts.limits.push_back(std::make_pair(
+                std::string(argv[i+1], equals - argv[i+1]),
+                strtod(equals + 1, nullptr)));
+        } else if (strcmp(argv[i], "-s") == 0) {
+            opts.scale = strtod(argv[i+1], nullptr);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (opts.calls == 0 || opts.batches == 0 || opts.threads == 0) {
+        fprintf(stderr, "The number of calls, batches and threads "
+            "must be positive\n");
+        return 1;
+    }
+    if (opts.scale <= 0.0) {
+        fprintf(stderr, "The scale of the limits must be positive\n");
+        return 1;
+    }
+    for (const auto& l : opts.limits) {
+        bool found = false;
+        for (const auto& b : benchmarks) {
+            found = found || l.first == b.name;
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown benchmark %s\n", l.first.c_str());
+            return 1;
+        }
+    }
+    std::vector<result> baseline;
+    if (opts.baseline != nullptr && !read_results(opts.baseline, baseline)) {
+        fprintf(stderr, "Unable to read %s\n", opts.baseline);
+        return 1;
+    }
+
+    PERFSTUBS_INITIALIZE();
+    std::vector<result> results;
+    for (const auto& b : benchmarks) {
+        for (unsigned int n = 1 ; n <= opts.threads ; n *= 2) {
+            std::vector<double> samples = run(b, n, opts);
+            std::sort(samples.begin(), samples.end());
+            result r;
+            r.benchmark = b.name;
+            r.threads = n;
+            r.calls = opts.calls * opts.batches * n;
+            r.min = samples.front();
+            r.p50 = percentile(samples, 0.50);
+            r.p90 = percentile(samples, 0.90);
+            r.p99 = percentile(samples, 0.99);
+            results.push_back(r);
+        }
+    }
+    PERFSTUBS_FINALIZE();
+
+    FILE * out = stdout;
+    if (opts.output != nullptr) {
+        out = fopen(opts.output, "w");
+        if (out == nullptr) {
+            fprintf(stderr, "Unable to open %s\n", opts.output);
+            return 1;
+        }
+    }
+    write_json(out, results, opts);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    int status = 0;
+    for (const auto& l : opts.limits) {
+        for (const auto& r : results) {
+            if (r.benchmark != l.first) {
+                continue;
+            }
+            const result * empty = find(results, "empty_loop", r.threads);
+            const result * base = find(baseline, r.benchmark, r.threads);
+            double overhead = r.p50 - (base != nullptr ? base->p50 : 0.0);
+            double limit = l.second * opts.scale * empty->p50;
+            if (overhead > limit) {
+                fprintf(stderr, "%s on %u threads: median of %.3f ns per "
+                    "call, %.3f over the baseline, more than %.3f (%g empty "
+                    "loop iterations)\n", r.benchmark.c_str(), r.threads,
+                    r.p50, overhead, limit, l.second * opts.scale);
+                status = 1;
+            }
+        }
+    }
+    if (status == 0) {
+        printf("Benchmark passed\n");
+    }
+    return status;
+}
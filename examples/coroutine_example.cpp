@@ -0,0 +1,138 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* Times coroutines that are suspended while they wait, and resumed on
+ * another thread, as with asynchronous I/O.  The time spent suspended must
+ * not be counted, and each stretch between suspensions is one call. */
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+const unsigned int num_requests = 8;
+const unsigned int wait_ms = 50;
+
+/* A coroutine that runs as soon as it is called, and is not waited for */
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return task(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept {
+            return std::suspend_never();
+        }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+std::mutex threads_mutex;
+std::vector<std::thread> threads;
+std::atomic<unsigned int> finished(0);
+
+/* Resumes the coroutine on a new thread, after a while */
+struct resume_later
+{
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        threads.push_back(std::thread([handle] {
+            PERFSTUBS_REGISTER_THREAD();
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+            handle.resume();
+        }));
+    }
+    void await_resume() {}
+};
+
+/* An awaitable that isn't an awaiter itself */
+struct delay
+{
+    resume_later operator co_await() { return resume_later(); }
+};
+
+volatile double sink = 0.0;
+
+void work(void)
+{
+    for (unsigned int i = 0 ; i < 10000 ; i++) {
+        sink = sink + i;
+    }
+}
+
+task request(void)
+{
+    {
+        PERFSTUBS_COROUTINE_TIMER(timer, "request");
+        work();
+        PERFSTUBS_CO_AWAIT(timer, resume_later());
+        work();
+        PERFSTUBS_CO_AWAIT(timer, delay());
+        work();
+    }
+    finished++;
+}
+
+/* The calls and inclusive time of a timer, summed over the threads */
+void totals(const char * name, double& calls, double& inclusive)
+{
+    ps_tool_timer_data_t data;
+    memset(&data, 0, sizeof(ps_tool_timer_data_t));
+    ps_get_timer_data_(&data);
+    calls = inclusive = 0.0;
+    for (unsigned int i = 0 ; i < data.num_timers ; i++) {
+        if (strcmp(data.timer_names[i], name) != 0) {
+            continue;
+        }
+        for (unsigned int t = 0 ; t < data.num_threads ; t++) {
+            const double * v = data.values +
+                ((size_t)i * data.num_threads + t) * data.num_metrics;
+            calls += v[0];
+            inclusive += v[1];
+        }
+    }
+    ps_free_timer_data_(&data);
+}
+
+int main(int argc, char* argv[])
+{
+    (void)(argc);
+    (void)(argv);
+    PERFSTUBS_INITIALIZE();
+    {
+        PERFSTUBS_SCOPED_TIMER("main");
+        for (unsigned int i = 0 ; i < num_requests ; i++) {
+            request();
+        }
+        while (finished < num_requests) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    PERFSTUBS_DUMP_DATA();
+    double calls, inclusive, main_calls, main_inclusive;
+    totals("request", calls, inclusive);
+    totals("main", main_calls, main_inclusive);
+    printf("request: %.0f calls, %f seconds\n", calls, inclusive);
+    /* Each request waits twice, so is timed in three stretches, and
+     * waits for longer than it runs */
+    if (calls == 3 * num_requests && main_calls == 1 &&
+        inclusive < num_requests * wait_ms * 1.0e-3) {
+        printf("Coroutines ok\n");
+    }
+    PERFSTUBS_FINALIZE();
+    return 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* Samples a counter from several threads.  The values have a large offset,
+ * so that the tool has to compute the variance in a numerically stable way
+ * to report the right standard deviation.  A second counter checks the
+ * 99th percentile computed from the histograms, if the tool keeps them. */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+const unsigned int num_threads = 4;
+const unsigned int num_samples = 1000;
+const double offset = 1.0e9;
+
+void sample(unsigned int id)
+{
+    PERFSTUBS_REGISTER_THREAD();
+    for (unsigned int i = 0 ; i < num_samples ; i++) {
+        PERFSTUBS_SAMPLE_COUNTER("samples",
+            offset + (double)(id * num_samples + i));
+        PERFSTUBS_SAMPLE_COUNTER("sizes", (double)(i + 1));
+    }
+}
+
+/* The p quantile of one histogram, summed over the threads, interpolating
+ * in the bucket it falls in */
+double quantile(const ps_tool_histogram_data_t& data, unsigned int index,
+    double p)
+{
+    std::vector<double> counts(data.num_buckets, 0.0);
+    double total = 0.0;
+    for (unsigned int t = 0 ; t < data.num_threads ; t++) {
+        const double * c = data.counts +
+            ((size_t)index * data.num_threads + t) * data.num_buckets;
+        for (unsigned int b = 0 ; b < data.num_buckets ; b++) {
+            counts[b] += c[b];
+            total += c[b];
+        }
+    }
+    double rank = p * total;
+    double below = 0.0;
+    for (unsigned int b = 0 ; b < data.num_buckets ; b++) {
+        if (counts[b] > 0.0 && below + counts[b] >= rank) {
+            return data.bucket_lower[b] + (data.bucket_upper[b] -
+                data.bucket_lower[b]) * (rank - below) / counts[b];
+        }
+        below += counts[b];
+    }
+    return 0.0;
+}
+
+void check_histogram(void)
+{
+    ps_tool_histogram_data_t data;
+    memset(&data, 0, sizeof(ps_tool_histogram_data_t));
+    ps_get_counter_histogram_(&data);
+    for (unsigned int i = 0 ; i < data.num_histograms ; i++) {
+        if (strcmp(data.names[i], "sizes") != 0) {
+            continue;
+        }
+        double p99 = quantile(data, i, 0.99);
+        double exact = 0.99 * num_samples;
+        printf("p99 of sizes = %.1f (exact %.1f)\n", p99, exact);
+        /* the buckets are at most 1/8 of their value wide */
+        if (std::fabs(p99 - exact) <= exact / 8.0) {
+            printf("Histogram ok\n");
+        }
+    }
+    ps_free_counter_histogram_(&data);
+}
+
+int main(int argc, char* argv[])
+{
+    (void)(argc);
+    (void)(argv);
+    PERFSTUBS_INITIALIZE();
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0 ; i < num_threads ; i++) {
+        threads.push_back(std::thread(sample, i));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    /* Should report the values 0 to 3999 (plus the offset): a mean of
+     * 1999.5 and a standard deviation of 1154.7005 */
+    PERFSTUBS_DUMP_DATA();
+    check_histogram();
+    PERFSTUBS_FINALIZE();
+    return 0;
+}
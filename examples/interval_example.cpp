@@ -0,0 +1,121 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* Times tasks that are begun on one thread and ended on another, as in a
+ * work-stealing scheduler, and asynchronous operations that overlap, with
+ * the interval API.  The workers also time themselves with nested timers,
+ * which the intervals must not disturb.  Every token is ended twice, and
+ * the second end must be ignored. */
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+const unsigned int num_workers = 4;
+const unsigned int num_tasks = 1000;
+const unsigned int num_operations = 16;
+
+std::mutex queue_mutex;
+std::condition_variable queue_ready;
+std::deque<uint64_t> queue;
+bool done = false;
+
+void worker(void)
+{
+    PERFSTUBS_REGISTER_THREAD();
+    PERFSTUBS_TIMER_START(timer, "worker");
+    for (;;) {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_ready.wait(lock, []{ return done || !queue.empty(); });
+        if (queue.empty()) {
+            break;
+        }
+        uint64_t token = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        PERFSTUBS_INTERVAL_END(token);
+        PERFSTUBS_INTERVAL_END(token);
+    }
+    PERFSTUBS_TIMER_STOP(timer);
+}
+
+/* The calls of a timer, summed over the threads */
+double calls(const char * name)
+{
+    ps_tool_timer_data_t data;
+    memset(&data, 0, sizeof(ps_tool_timer_data_t));
+    ps_get_timer_data_(&data);
+    double total = 0.0;
+    for (unsigned int i = 0 ; i < data.num_timers ; i++) {
+        if (strcmp(data.timer_names[i], name) != 0) {
+            continue;
+        }
+        for (unsigned int t = 0 ; t < data.num_threads ; t++) {
+            /* the first metric is the number of calls */
+            total += data.values[((size_t)i * data.num_threads + t) *
+                data.num_metrics];
+        }
+    }
+    ps_free_timer_data_(&data);
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    (void)(argc);
+    (void)(argv);
+    PERFSTUBS_INITIALIZE();
+    void * task = ps_timer_create_("task");
+    void * operation = ps_timer_create_("operation");
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0 ; i < num_workers ; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    /* The tasks are begun here and ended by the workers */
+    for (unsigned int i = 0 ; i < num_tasks ; i++) {
+        uint64_t token;
+        PERFSTUBS_INTERVAL_BEGIN(token, task);
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(token);
+        queue_ready.notify_one();
+    }
+    /* Overlapping operations, ended in a different order than begun */
+    uint64_t tokens[num_operations];
+    for (unsigned int i = 0 ; i < num_operations ; i++) {
+        PERFSTUBS_INTERVAL_BEGIN(tokens[i], operation);
+    }
+    for (unsigned int i = 0 ; i < num_operations ; i += 2) {
+        PERFSTUBS_INTERVAL_END(tokens[i]);
+    }
+    for (unsigned int i = 1 ; i < num_operations ; i += 2) {
+        PERFSTUBS_INTERVAL_END(tokens[i]);
+        PERFSTUBS_INTERVAL_END(tokens[i]);
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        done = true;
+        queue_ready.notify_all();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    PERFSTUBS_DUMP_DATA();
+    double tasks = calls("task");
+    double operations = calls("operation");
+    double workers = calls("worker");
+    printf("task: %.0f calls, operation: %.0f calls, worker: %.0f calls\n",
+        tasks, operations, workers);
+    if (tasks == num_tasks && operations == num_operations &&
+        workers == num_workers) {
+        printf("Intervals ok\n");
+    }
+    PERFSTUBS_FINALIZE();
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* A time stepping loop, with many more iterations than the tool keeps
+ * (with PS_TOOL_PHASE_ITERATIONS=1000), and a nested phase started twice
+ * per step.  The iterations that are no longer kept must still be counted
+ * in the summary of each phase. */
+
+#include <cstdio>
+#include <cstdlib>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+volatile double sink = 0.0;
+
+void solve(void)
+{
+    for (unsigned int i = 0 ; i < 100 ; i++) {
+        sink = sink + i;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int steps = argc > 1 ? atoi(argv[1]) : 100000;
+    PERFSTUBS_INITIALIZE();
+    for (int step = 0 ; step < steps ; step++) {
+        PERFSTUBS_DYNAMIC_PHASE_START("step", step);
+        for (int k = 0 ; k < 2 ; k++) {
+            PERFSTUBS_DYNAMIC_PHASE_START("solve", step);
+            solve();
+            PERFSTUBS_DYNAMIC_PHASE_STOP("solve", step);
+        }
+        PERFSTUBS_DYNAMIC_PHASE_STOP("step", step);
+    }
+    PERFSTUBS_DUMP_DATA();
+    PERFSTUBS_FINALIZE();
+    return 0;
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* Nests a sampled timer between two timed ones.  The calls of the sampled
+ * timer that are skipped still contain the inner timer, whose time must
+ * not be taken from the exclusive time of the outer timer, and the inner
+ * timer must appear below the sampled one in the call paths.  The time of
+ * the inner timer in the sampled calls is extrapolated with them, so the
+ * exclusive time of the sampled timer stays small. */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+const unsigned int iterations = 16;
+const unsigned int period = 4;
+/* the work of the outer and inner timers, in each iteration */
+const double work = 0.002;
+
+void spin(double seconds)
+{
+    auto end = std::chrono::steady_clock::now() +
+        std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+/* A metric of a timer, summed over the threads */
+double metric(const char * name, unsigned int index)
+{
+    ps_tool_timer_data_t data;
+    memset(&data, 0, sizeof(ps_tool_timer_data_t));
+    ps_get_timer_data_(&data);
+    double total = 0.0;
+    for (unsigned int i = 0 ; i < data.num_timers ; i++) {
+        if (strcmp(data.timer_names[i], name) != 0) {
+            continue;
+        }
+        for (unsigned int t = 0 ; t < data.num_threads ; t++) {
+            total += data.values[((size_t)i * data.num_threads + t) *
+                data.num_metrics + index];
+        }
+    }
+    ps_free_timer_data_(&data);
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    (void)(argc);
+    (void)(argv);
+    PERFSTUBS_INITIALIZE();
+    void * outer = ps_timer_create_("outer");
+    void * middle = ps_timer_create_("middle");
+    void * inner = ps_timer_create_("inner");
+    ps_set_sampling_(middle, period);
+    ps_timer_start_(outer);
+    for (unsigned int i = 0 ; i < iterations ; i++) {
+        spin(work);
+        ps_timer_start_(middle);
+        ps_timer_start_(inner);
+        spin(work);
+        ps_timer_stop_(inner);
+        ps_timer_stop_(middle);
+    }
+    ps_timer_stop_(outer);
+    PERFSTUBS_DUMP_DATA();
+    /* The second metric is the inclusive time and the third the exclusive
+     * time.  middle is only called from outer, so the exclusive time of
+     * outer is its inclusive time less that of middle, whatever the error
+     * of the extrapolation; the time of inner in the skipped calls of
+     * middle would take three quarters of the time of inner from it.
+     * middle does no work of its own, so its exclusive time is small. */
+    double outer_inclusive = metric("outer", 1);
+    double outer_exclusive = metric("outer", 2);
+    double middle_inclusive = metric("middle", 1);
+    double middle_exclusive = metric("middle", 2);
+    double inner_inclusive = metric("inner", 1);
+    double expected = std::max(0.0, outer_inclusive - middle_inclusive);
+    printf("outer: %.6f exclusive, %.6f expected, middle: %.6f exclusive\n",
+        outer_exclusive, expected, middle_exclusive);
+    if (expected - outer_exclusive < 0.25 * inner_inclusive &&
+        middle_exclusive < 0.25 * middle_inclusive) {
+        printf("Sampling ok\n");
+    }
+    PERFSTUBS_FINALIZE();
+    return 0;
+}
@@ -0,0 +1,239 @@
+/* Copyright (c) 2019-2022 University of Oregon
+ * Distributed under the BSD Software License
+ * (See accompanying file LICENSE.txt) */
+
+/* Measures how the throughput of the timer and counter calls scales with
+ * the number of threads, to make contention in the tool or the dispatch
+ * layer visible.  Threads either share one timer (or counter) or each use
+ * their own, and a thread churn test starts many short-lived threads.
+ *
+ * Usage: scaling_benchmark [options]
+ *   -n <calls>    calls per thread (default 1000000)
+ *   -t <threads>  maximum number of threads (default: the number of cores)
+ *   -c <threads>  short-lived threads started per thread (default 1000)
+ *   -o <file>     write the JSON results to a file instead of stdout
+ *
+ * The efficiency is the throughput per thread, relative to one thread, and
+ * is also printed for the maximum number of threads. */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#define PERFSTUBS_USE_TIMERS
+#include "perfstubs_api/timer.h"
+
+#ifndef PS_BENCHMARK_TOOL
+#define PS_BENCHMARK_TOOL "unknown"
+#endif
+
+struct options {
+    size_t calls{1000000};
+    unsigned int threads{0};
+    size_t churn{1000};
+    const char * output{nullptr};
+};
+
+struct result {
+    std::string benchmark;
+    unsigned int threads;
+    size_t calls;
+    double seconds;
+    double per_thread;
+    double efficiency;
+};
+
+void * shared_timer{nullptr};
+void * shared_counter{nullptr};
+
+/* The handles are created before the threads start timing, so that the
+ * mutex taken to create a timer or counter isn't measured */
+void * shared_timer_handle(unsigned int id) {
+    (void)(id);
+    return shared_timer;
+}
+
+void * private_timer_handle(unsigned int id) {
+    std::string name("private timer " + std::to_string(id));
+    return ps_timer_create_(name.c_str());
+}
+
+void * shared_counter_handle(unsigned int id) {
+    (void)(id);
+    return shared_counter;
+}
+
+void * private_counter_handle(unsigned int id) {
+    std::string name("private counter " + std::to_string(id));
+    return ps_create_counter_(name.c_str());
+}
+
+void timer_calls(void * timer, size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        ps_timer_start_(timer);
+        ps_timer_stop_(timer);
+    }
+}
+
+void counter_calls(void * counter, size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        ps_sample_counter_(counter, (double)i);
+    }
+}
+
+/* Each call is one short-lived thread, which registers itself and starts
+ * and stops the timer a few times */
+void thread_churn_calls(void * timer, size_t calls) {
+    for (size_t i = 0 ; i < calls ; i++) {
+        std::thread t([timer]() {
+            PERFSTUBS_REGISTER_THREAD();
+            for (int j = 0 ; j < 10 ; j++) {
+                ps_timer_start_(timer);
+                ps_timer_stop_(timer);
+            }
+        });
+        t.join();
+    }
+}
+
+struct benchmark {
+    const char * name;
+    void * (*handle)(unsigned int);
+    void (*function)(void *, size_t);
+    bool churn;
+};
+
+const benchmark benchmarks[] = {
+    {"shared_timer", shared_timer_handle, timer_calls, false},
+    {"private_timer", private_timer_handle, timer_calls, false},
+    {"shared_counter", shared_counter_handle, counter_calls, false},
+    {"private_counter", private_counter_handle, counter_calls, false},
+    {"thread_churn", shared_timer_handle, thread_churn_calls, true}
+};
+
+/* Run one benchmark on n threads, and return the elapsed seconds */
+double run(const benchmark& b, unsigned int n, size_t calls) {
+    std::atomic<unsigned int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0 ; t < n ; t++) {
+        threads.push_back(std::thread([&, t]() {
+            PERFSTUBS_REGISTER_THREAD();
+            void * handle = b.handle(t);
+            ready++;
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            b.function(handle, calls);
+        }));
+    }
+    while (ready.load() < n) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void write_json(FILE * out, const std::vector<result>& results) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"tool\": \"%s\",\n", PS_BENCHMARK_TOOL);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0 ; i < results.size() ; i++) {
+        const result& r = results[i];
+        fprintf(out, "    {\"benchmark\": \"%s\", \"threads\": %u, "
+            "\"calls\": %zu, \"seconds\": %.6f, "
+            "\"calls_per_second_per_thread\": %.1f, "
+            "\"efficiency\": %.3f}%s\n",
+            r.benchmark.c_str(), r.threads, r.calls, r.seconds,
+            r.per_thread, r.efficiency, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+    for (int i = 1 ; i + 1 < argc ; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            opts.calls = strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            opts.threads = strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            opts.churn = strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            opts.output = argv[i+1];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (opts.threads == 0) {
+        opts.threads = std::thread::hardware_concurrency();
+        if (opts.threads == 0) {
+            opts.threads = 1;
+        }
+    }
+    if (opts.calls == 0 || opts.churn == 0) {
+        fprintf(stderr, "The number of calls and threads must be positive\n");
+        return 1;
+    }
+
+    PERFSTUBS_INITIALIZE();
+    shared_timer = ps_timer_create_("shared timer");
+    shared_counter = ps_create_counter_("shared counter");
+    /* powers of two, and the maximum */
+    std::vector<unsigned int> counts;
+    for (unsigned int n = 1 ; n < opts.threads ; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(opts.threads);
+    std::vector<result> results;
+    for (const auto& b : benchmarks) {
+        size_t calls = b.churn ? opts.churn : opts.calls;
+        double single = 0.0;
+        for (auto n : counts) {
+            result r;
+            r.benchmark = b.name;
+            r.threads = n;
+            r.calls = calls * n;
+            r.seconds = run(b, n, calls);
+            r.per_thread = (double)calls / r.seconds;
+            if (n == 1) {
+                single = r.per_thread;
+            }
+            r.efficiency = r.per_thread / single;
+            results.push_back(r);
+        }
+    }
+    PERFSTUBS_FINALIZE();
+
+    FILE * out = stdout;
+    if (opts.output != nullptr) {
+        out = fopen(opts.output, "w");
+        if (out == nullptr) {
+            fprintf(stderr, "Unable to open %s\n", opts.output);
+            return 1;
+        }
+    }
+    write_json(out, results);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (const auto& r : results) {
+        if (r.threads == opts.threads) {
+            printf("%s: %.3f efficiency on %u threads\n",
+                r.benchmark.c_str(), r.efficiency, r.threads);
+        }
+    }
+    printf("Scaling benchmark done\n");
+    return 0;
+}
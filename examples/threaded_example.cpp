@@ -2,6 +2,7 @@
  * Distributed under the BSD Software License
  * (See accompanying file LICENSE.txt) */
 
+#include <cstring>
 #include <iostream>
 #include <thread>
 #include <vector>
@@ -18,6 +19,16 @@ void foo()
     usleep(1);
 }
 
+/* Only starts a timer created by another thread, so the thread is only
+ * seen by the tool */
+void bar(void * timer)
+{
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) {
+        ps_timer_start_inline_(timer);
+        ps_timer_stop_inline_(timer);
+    }
+}
+
 int main(int argc, char* argv[])
 {
     PERFSTUBS_INITIALIZE();
@@ -38,6 +49,20 @@ int main(int argc, char* argv[])
             t.join();
         }
     }
+    /* The threads that exited are reused, even if PerfStubs never saw
+     * them */
+    void * timer = ps_timer_create_("bar");
+    for (unsigned int i = 0; i < 16 ; i++) {
+        std::thread t(bar, timer);
+        t.join();
+    }
+    ps_tool_timer_data_t data;
+    memset(&data, 0, sizeof(ps_tool_timer_data_t));
+    ps_get_timer_data_(&data);
+    if (data.num_threads > 0 && data.num_threads <= cores + 1) {
+        std::cout << "Threads reused" << std::endl;
+    }
+    ps_free_timer_data_(&data);
 }
 
 
@@ -23,64 +23,102 @@
 /* Globals for the plugin API */
 
 int perfstubs_initialized = PERFSTUBS_UNKNOWN;
+/* Set while ps_initialize_() runs, before the state is published */
+static int perfstubs_initializing = 0;
 int num_tools_registered = 0;
-/* Keep track of whether the thread has been registered */
-/* __thread int thread_seen = 0; */
-/* Implemented with PGI-friendly implementation, they can't be bothered
- * to implement the thread_local standard like every other compiler... */
+/* Keep track of whether the thread has been registered.  Where the
+ * compiler supports it, a thread local flag (with the TLS model selected at
+ * configuration time) is checked first.  Otherwise, use the PGI-friendly
+ * implementation, they can't be bothered to implement the thread_local
+ * standard like every other compiler...  The pthread key is set in both
+ * cases, so that its destructor can tell the tool when the thread exits. */
+#if defined(PERFSTUBS_HAVE_TLS)
+static __thread int thread_seen
+    __attribute__((tls_model(PERFSTUBS_TLS_MODEL))) = 0;
+#endif
 static pthread_key_t key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
+static void ps_thread_exit(void * value);
+
 static void make_key(void) {
-    (void) pthread_key_create(&key, NULL);
-}
+    (void) pthread_key_create(&key, ps_thread_exit);
+}
+
+/* Registered timer sites, hashed by id */
+#define PS_TIMER_SITE_BUCKETS 1024
+static ps_timer_site_t * timer_sites[PS_TIMER_SITE_BUCKETS];
+static pthread_mutex_t timer_site_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Interned timer names for the string API.  The global table is a fixed
+ * size, open addressing hash table of names, each with the handle created
+ * for it.  Entries are inserted with compare-and-swap and never removed, so
+ * lookups take no lock.  If the table fills up, the string API falls back
+ * to calling the tools' string functions. */
+#define PS_STRING_TABLE_SIZE 4096
+#define PS_STRING_PROBES 64
+typedef struct ps_string_entry {
+    uint64_t hash;
+    void *handle;
+    char name[];
+} ps_string_entry_t;
+static ps_string_entry_t * string_table[PS_STRING_TABLE_SIZE];
+/* Only set if every tool can create, start and stop a timer handle */
+static int string_cache_enabled = 0;
+
+#if defined(PERFSTUBS_HAVE_TLS)
+/* A small per-thread cache in front of the global table, keyed on the
+ * address of the name.  The name is still compared, in case the same
+ * buffer is reused for another name. */
+#define PS_STRING_CACHE_SIZE 16
+typedef struct ps_string_cache {
+    const char *key;
+    ps_string_entry_t *entry;
+} ps_string_cache_t;
+static __thread ps_string_cache_t string_cache[PS_STRING_CACHE_SIZE]
+    __attribute__((tls_model(PERFSTUBS_TLS_MODEL)));
+#endif
+
+/* The dispatch table.  Tools register themselves with ps_register_tool(),
+ * usually from a constructor.  When PerfStubs is initialized, a tool that
+ * exports the ps_tool_* symbols is also added, if it isn't registered
+ * already.  The set of tools is fixed from then on. */
+
+#define PS_MAX_TOOLS 8
 
-/* Function pointers */
+static ps_plugin_data_t tools[PS_MAX_TOOLS];
 
-ps_initialize_t initialize_function;
-ps_finalize_t finalize_function;
-ps_pause_measurement_t pause_measurement_function;
-ps_resume_measurement_t resume_measurement_function;
-ps_register_thread_t register_thread_function;
-ps_dump_data_t dump_data_function;
-ps_timer_create_t timer_create_function;
+/* The hot-path entries of each tool, packed together so that fanning out
+ * a timer start or stop touches as few cache lines as possible. */
+typedef struct ps_tool_hot {
+    ps_timer_start_t timer_start;
+    ps_timer_stop_t timer_stop;
+    ps_sample_counter_t sample_counter;
+} ps_tool_hot_t;
+
+static ps_tool_hot_t hot_tools[PS_MAX_TOOLS];
+
+/* The hot-path function pointers called by the macros in timer.h.  With
+ * one tool, they point straight at the tool, and a handle is the tool's own
+ * timer or counter object.  With more than one tool, a handle is an array
+ * of objects, one per tool, and these point at the fan-out functions. */
 ps_timer_start_t timer_start_function;
 ps_timer_stop_t timer_stop_function;
-ps_start_string_t start_string_function;
-ps_stop_string_t stop_string_function;
-ps_stop_current_t stop_current_function;
-ps_set_parameter_t set_parameter_function;
-ps_dynamic_phase_start_t dynamic_phase_start_function;
-ps_dynamic_phase_stop_t dynamic_phase_stop_function;
-ps_create_counter_t create_counter_function;
 ps_sample_counter_t sample_counter_function;
-ps_set_metadata_t set_metadata_function;
-ps_get_timer_data_t get_timer_data_function;
-ps_get_counter_data_t get_counter_data_function;
-ps_get_metadata_t get_metadata_function;
-ps_free_timer_data_t free_timer_data_function;
-ps_free_counter_data_t free_counter_data_function;
-ps_free_metadata_t free_metadata_function;
 
 #ifdef PERFSTUBS_USE_STATIC
 
-#if defined(__clang__) && defined(__APPLE__)
-#define PS_WEAK_PRE
-#define PS_WEAK_POST __attribute__((weak_import))
-#define PS_WEAK_POST_NULL __attribute__((weak_import))
-#else
-#define PS_WEAK_PRE __attribute__((weak))
-#define PS_WEAK_POST
-#define PS_WEAK_POST_NULL
-#endif
+/* PS_WEAK_PRE and PS_WEAK_POST are defined in timer.h */
 
 PS_WEAK_PRE void ps_tool_initialize(void) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_finalize(void) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_pause_measurement(void) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_resume_measurement(void) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_register_thread(void) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_deregister_thread(void) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_dump_data(void) PS_WEAK_POST;
 PS_WEAK_PRE void* ps_tool_timer_create(const char *) PS_WEAK_POST;
+PS_WEAK_PRE void* ps_tool_timer_create_location(const char *, const char *, int) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_timer_start(void *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_timer_stop(void *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_start_string(const char *) PS_WEAK_POST;
@@ -92,106 +130,272 @@ PS_WEAK_PRE void ps_tool_dynamic_phase_stop(const char *, int) PS_WEAK_POST;
 PS_WEAK_PRE void* ps_tool_create_counter(const char *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_sample_counter(void *, double) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_set_metadata(const char *, const char *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_set_sampling(void *, unsigned int) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_get_timer_data(ps_tool_timer_data_t *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_get_counter_data(ps_tool_counter_data_t *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_get_metadata(ps_tool_metadata_t *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_free_timer_data(ps_tool_timer_data_t *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_free_counter_data(ps_tool_counter_data_t *) PS_WEAK_POST;
 PS_WEAK_PRE void ps_tool_free_metadata(ps_tool_metadata_t *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_get_timer_histogram(ps_tool_histogram_data_t *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_get_counter_histogram(ps_tool_histogram_data_t *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_free_histogram_data(ps_tool_histogram_data_t *) PS_WEAK_POST;
+PS_WEAK_PRE uint64_t ps_tool_interval_begin(void *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_interval_end(uint64_t) PS_WEAK_POST;
 #endif
 
-void initialize_library(void) {
+/* No-op versions of the hot-path functions, used when the tool doesn't
+ * implement them, so that the macros in timer.h never have to check for
+ * NULL before calling through the dispatch table. */
+static void ps_null_timer_start(void * timer) { (void)(timer); }
+static void ps_null_timer_stop(void * timer) { (void)(timer); }
+static void ps_null_sample_counter(void * counter, double value) {
+    (void)(counter); (void)(value);
+}
+
+/* Fan-out versions of the hot-path functions, for more than one tool.
+ * Timers are stopped in the reverse order they were started, so that each
+ * tool's overhead falls outside the measurements of the tools before it.
+ * A handle is NULL if it couldn't be created, or if it is the handle of a
+ * timer site used before initialization finished. */
+static void ps_multi_timer_start(void * timer) {
+    void ** objects = (void **)timer;
+    int i;
+    if (objects == NULL)
+        return;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (hot_tools[i].timer_start != NULL)
+            hot_tools[i].timer_start(objects[i]);
+    }
+}
+
+static void ps_multi_timer_stop(void * timer) {
+    void ** objects = (void **)timer;
+    int i;
+    if (objects == NULL)
+        return;
+    for (i = num_tools_registered - 1 ; i >= 0 ; i--) {
+        if (hot_tools[i].timer_stop != NULL)
+            hot_tools[i].timer_stop(objects[i]);
+    }
+}
+
+static void ps_multi_sample_counter(void * counter, double value) {
+    void ** objects = (void **)counter;
+    int i;
+    if (objects == NULL)
+        return;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (hot_tools[i].sample_counter != NULL)
+            hot_tools[i].sample_counter(objects[i], value);
+    }
+}
+
+/* The given tool's object in a timer or counter handle */
+static inline void * ps_tool_object(void * handle, int tool_id) {
+    return num_tools_registered == 1 ? handle : ((void **)handle)[tool_id];
+}
+
+int ps_register_tool(ps_plugin_data_t * tool) {
+    /* Handles are created for the set of tools known at initialization */
+    if (perfstubs_initialized != PERFSTUBS_UNKNOWN || perfstubs_initializing ||
+            num_tools_registered >= PS_MAX_TOOLS) {
+        return -1;
+    }
+    tools[num_tools_registered] = *tool;
+    num_tools_registered = num_tools_registered + 1;
+    return (num_tools_registered - 1);
+}
+
+/* The tool's entries are cleared, rather than removing it from the table,
+ * so that the ids of the other tools (and the layout of existing handles)
+ * stay the same. */
+void ps_deregister_tool(int tool_id) {
+    if (tool_id < 0 || tool_id >= num_tools_registered) {
+        return;
+    }
+    memset(&tools[tool_id], 0, sizeof(ps_plugin_data_t));
+    memset(&hot_tools[tool_id], 0, sizeof(ps_tool_hot_t));
+    if (num_tools_registered == 1) {
+        timer_start_function = &ps_null_timer_start;
+        timer_stop_function = &ps_null_timer_stop;
+        sample_counter_function = &ps_null_sample_counter;
+    }
+}
+
+/* Look up a single tool by the ps_tool_* symbol names.  Returns 0 if there
+ * is no tool. */
+static int ps_find_tool(ps_plugin_data_t * tool) {
+    memset(tool, 0, sizeof(ps_plugin_data_t));
 #ifdef PERFSTUBS_USE_STATIC
     /* The initialization function is the only required one */
-    initialize_function = &ps_tool_initialize;
-    if (initialize_function == NULL) {
-        perfstubs_initialized = PERFSTUBS_FAILURE;
-        return;
+    tool->initialize = &ps_tool_initialize;
+    if (tool->initialize == NULL) {
+        return 0;
     }
     // removing printf statement for now, it's too noisy.
     //printf("Found ps_tool_initialize(), registering tool\n");
-    finalize_function = &ps_tool_finalize;
-    pause_measurement_function = &ps_tool_pause_measurement;
-    resume_measurement_function = &ps_tool_resume_measurement;
-    register_thread_function = &ps_tool_register_thread;
-    dump_data_function = &ps_tool_dump_data;
-    timer_create_function = &ps_tool_timer_create;
-    timer_start_function = &ps_tool_timer_start;
-    timer_stop_function = &ps_tool_timer_stop;
-    start_string_function = &ps_tool_start_string;
-    stop_string_function = &ps_tool_stop_string;
-    stop_current_function = &ps_tool_stop_current;
-    set_parameter_function = &ps_tool_set_parameter;
-    dynamic_phase_start_function = &ps_tool_dynamic_phase_start;
-    dynamic_phase_stop_function = &ps_tool_dynamic_phase_stop;
-    create_counter_function = &ps_tool_create_counter;
-    sample_counter_function = &ps_tool_sample_counter;
-    set_metadata_function = &ps_tool_set_metadata;
-    get_timer_data_function = &ps_tool_get_timer_data;
-    get_counter_data_function = &ps_tool_get_counter_data;
-    get_metadata_function = &ps_tool_get_metadata;
-    free_timer_data_function = &ps_tool_free_timer_data;
-    free_counter_data_function = &ps_tool_free_counter_data;
-    free_metadata_function = &ps_tool_free_metadata;
+    tool->finalize = &ps_tool_finalize;
+    tool->pause_measurement = &ps_tool_pause_measurement;
+    tool->resume_measurement = &ps_tool_resume_measurement;
+    tool->register_thread = &ps_tool_register_thread;
+    tool->deregister_thread = &ps_tool_deregister_thread;
+    tool->dump_data = &ps_tool_dump_data;
+    tool->timer_create = &ps_tool_timer_create;
+    tool->timer_create_location = &ps_tool_timer_create_location;
+    tool->timer_start = &ps_tool_timer_start;
+    tool->timer_stop = &ps_tool_timer_stop;
+    tool->start_string = &ps_tool_start_string;
+    tool->stop_string = &ps_tool_stop_string;
+    tool->stop_current = &ps_tool_stop_current;
+    tool->set_parameter = &ps_tool_set_parameter;
+    tool->dynamic_phase_start = &ps_tool_dynamic_phase_start;
+    tool->dynamic_phase_stop = &ps_tool_dynamic_phase_stop;
+    tool->create_counter = &ps_tool_create_counter;
+    tool->sample_counter = &ps_tool_sample_counter;
+    tool->set_metadata = &ps_tool_set_metadata;
+    tool->set_sampling = &ps_tool_set_sampling;
+    tool->get_timer_data = &ps_tool_get_timer_data;
+    tool->get_counter_data = &ps_tool_get_counter_data;
+    tool->get_metadata = &ps_tool_get_metadata;
+    tool->free_timer_data = &ps_tool_free_timer_data;
+    tool->free_counter_data = &ps_tool_free_counter_data;
+    tool->free_metadata = &ps_tool_free_metadata;
+    tool->get_timer_histogram = &ps_tool_get_timer_histogram;
+    tool->get_counter_histogram = &ps_tool_get_counter_histogram;
+    tool->free_histogram_data = &ps_tool_free_histogram_data;
+    tool->interval_begin = &ps_tool_interval_begin;
+    tool->interval_end = &ps_tool_interval_end;
 #else
-    initialize_function =
+    tool->initialize =
         (ps_initialize_t)dlsym(RTLD_DEFAULT, "ps_tool_initialize");
-    if (initialize_function == NULL) {
-        perfstubs_initialized = PERFSTUBS_FAILURE;
-        return;
+    if (tool->initialize == NULL) {
+        return 0;
     }
     printf("Found ps_tool_initialize(), registering tool\n");
-    finalize_function =
+    tool->finalize =
         (ps_finalize_t)dlsym(RTLD_DEFAULT, "ps_tool_finalize");
-    pause_measurement_function =
+    tool->pause_measurement =
         (ps_pause_measurement_t)dlsym(RTLD_DEFAULT, "ps_tool_pause_measurement");
-    resume_measurement_function =
+    tool->resume_measurement =
         (ps_resume_measurement_t)dlsym(RTLD_DEFAULT, "ps_tool_resume_measurement");
-    register_thread_function =
+    tool->register_thread =
         (ps_register_thread_t)dlsym(RTLD_DEFAULT, "ps_tool_register_thread");
-    dump_data_function =
+    tool->deregister_thread =
+        (ps_deregister_thread_t)dlsym(RTLD_DEFAULT, "ps_tool_deregister_thread");
+    tool->dump_data =
         (ps_dump_data_t)dlsym(RTLD_DEFAULT, "ps_tool_dump_data");
-    timer_create_function =
+    tool->timer_create =
         (ps_timer_create_t)dlsym(RTLD_DEFAULT,
                 "ps_tool_timer_create");
-    timer_start_function =
+    tool->timer_create_location =
+        (ps_timer_create_location_t)dlsym(RTLD_DEFAULT,
+                "ps_tool_timer_create_location");
+    tool->timer_start =
         (ps_timer_start_t)dlsym(RTLD_DEFAULT, "ps_tool_timer_start");
-    timer_stop_function =
+    tool->timer_stop =
         (ps_timer_stop_t)dlsym(RTLD_DEFAULT, "ps_tool_timer_stop");
-    start_string_function =
+    tool->start_string =
         (ps_start_string_t)dlsym(RTLD_DEFAULT, "ps_tool_start_string");
-    stop_string_function =
+    tool->stop_string =
         (ps_stop_string_t)dlsym(RTLD_DEFAULT, "ps_tool_stop_string");
-    stop_current_function =
+    tool->stop_current =
         (ps_stop_current_t)dlsym(RTLD_DEFAULT, "ps_tool_stop_current");
-    set_parameter_function =
+    tool->set_parameter =
         (ps_set_parameter_t)dlsym(RTLD_DEFAULT, "ps_tool_set_parameter");
-    dynamic_phase_start_function = (ps_dynamic_phase_start_t)dlsym(
+    tool->dynamic_phase_start = (ps_dynamic_phase_start_t)dlsym(
             RTLD_DEFAULT, "ps_tool_dynamic_phase_start");
-    dynamic_phase_stop_function = (ps_dynamic_phase_stop_t)dlsym(
+    tool->dynamic_phase_stop = (ps_dynamic_phase_stop_t)dlsym(
             RTLD_DEFAULT, "ps_tool_dynamic_phase_stop");
-    create_counter_function = (ps_create_counter_t)dlsym(
+    tool->create_counter = (ps_create_counter_t)dlsym(
             RTLD_DEFAULT, "ps_tool_create_counter");
-    sample_counter_function = (ps_sample_counter_t)dlsym(
+    tool->sample_counter = (ps_sample_counter_t)dlsym(
             RTLD_DEFAULT, "ps_tool_sample_counter");
-    set_metadata_function =
+    tool->set_metadata =
         (ps_set_metadata_t)dlsym(RTLD_DEFAULT, "ps_tool_set_metadata");
-    get_timer_data_function = (ps_get_timer_data_t)dlsym(
+    tool->set_sampling =
+        (ps_set_sampling_t)dlsym(RTLD_DEFAULT, "ps_tool_set_sampling");
+    tool->get_timer_data = (ps_get_timer_data_t)dlsym(
             RTLD_DEFAULT, "ps_tool_get_timer_data");
-    get_counter_data_function = (ps_get_counter_data_t)dlsym(
+    tool->get_counter_data = (ps_get_counter_data_t)dlsym(
             RTLD_DEFAULT, "ps_tool_get_counter_data");
-    get_metadata_function = (ps_get_metadata_t)dlsym(
+    tool->get_metadata = (ps_get_metadata_t)dlsym(
             RTLD_DEFAULT, "ps_tool_get_metadata");
-    free_timer_data_function = (ps_free_timer_data_t)dlsym(
+    tool->free_timer_data = (ps_free_timer_data_t)dlsym(
             RTLD_DEFAULT, "ps_tool_free_timer_data");
-    free_counter_data_function = (ps_free_counter_data_t)dlsym(
+    tool->free_counter_data = (ps_free_counter_data_t)dlsym(
             RTLD_DEFAULT, "ps_tool_free_counter_data");
-    free_metadata_function = (ps_free_metadata_t)dlsym(
+    tool->free_metadata = (ps_free_metadata_t)dlsym(
             RTLD_DEFAULT, "ps_tool_free_metadata");
+    tool->get_timer_histogram = (ps_get_timer_histogram_t)dlsym(
+            RTLD_DEFAULT, "ps_tool_get_timer_histogram");
+    tool->get_counter_histogram = (ps_get_counter_histogram_t)dlsym(
+            RTLD_DEFAULT, "ps_tool_get_counter_histogram");
+    tool->free_histogram_data = (ps_free_histogram_data_t)dlsym(
+            RTLD_DEFAULT, "ps_tool_free_histogram_data");
+    tool->interval_begin = (ps_interval_begin_t)dlsym(
+            RTLD_DEFAULT, "ps_tool_interval_begin");
+    tool->interval_end = (ps_interval_end_t)dlsym(
+            RTLD_DEFAULT, "ps_tool_interval_end");
 #endif
-    perfstubs_initialized = PERFSTUBS_SUCCESS;
-    /* Increment the number of tools */
-    num_tools_registered = 1;
+    return 1;
+}
+
+void initialize_library(void) {
+    ps_plugin_data_t tool;
+    int i;
+#if defined(PERFSTUBS_STATIC_BINDING)
+    /* The macros call the ps_tool_* functions directly, with the handles
+     * created here, so only that tool can be used. */
+    if (ps_find_tool(&tool)) {
+        tools[0] = tool;
+        num_tools_registered = 1;
+    }
+#else
+    /* Add the tool found by name, unless it registered itself too */
+    if (ps_find_tool(&tool) && num_tools_registered < PS_MAX_TOOLS) {
+        for (i = 0 ; i < num_tools_registered ; i++) {
+            if (tools[i].initialize == tool.initialize) {
+                break;
+            }
+        }
+        if (i == num_tools_registered) {
+            tools[num_tools_registered] = tool;
+            num_tools_registered = num_tools_registered + 1;
+        }
+    }
+#endif
+    if (num_tools_registered == 0) {
+        perfstubs_initialized = PERFSTUBS_FAILURE;
+        return;
+    }
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        hot_tools[i].timer_start = tools[i].timer_start;
+        hot_tools[i].timer_stop = tools[i].timer_stop;
+        hot_tools[i].sample_counter = tools[i].sample_counter;
+    }
+    if (num_tools_registered == 1) {
+        timer_start_function = tools[0].timer_start;
+        timer_stop_function = tools[0].timer_stop;
+        sample_counter_function = tools[0].sample_counter;
+        if (timer_start_function == NULL)
+            timer_start_function = &ps_null_timer_start;
+        if (timer_stop_function == NULL)
+            timer_stop_function = &ps_null_timer_stop;
+        if (sample_counter_function == NULL)
+            sample_counter_function = &ps_null_sample_counter;
+    } else {
+        timer_start_function = &ps_multi_timer_start;
+        timer_stop_function = &ps_multi_timer_stop;
+        sample_counter_function = &ps_multi_sample_counter;
+    }
+    string_cache_enabled = 1;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].timer_create == NULL || tools[i].timer_start == NULL ||
+                tools[i].timer_stop == NULL) {
+            string_cache_enabled = 0;
+        }
+    }
 }
 
 char * ps_make_timer_name_(const char * file,
@@ -203,66 +407,290 @@ char * ps_make_timer_name_(const char * file,
     return (name);
 }
 
+static void * ps_create_timer(const char *timer_name);
+
+/* Create the handle for a site, unless a site with the same id and name
+ * already has one (the same site, in several shared objects or inline
+ * function instances).  Sites whose ids collide get their own handles.
+ * Called with the timer site mutex held, once the tools are initialized. */
+static void ps_create_timer_site(ps_timer_site_t * site) {
+    ps_timer_site_t * other = timer_sites[site->id % PS_TIMER_SITE_BUCKETS];
+    for ( ; other != NULL ; other = other->next) {
+        if (other != site && other->id == site->id && other->handle != NULL &&
+                strcmp(other->name, site->name) == 0) {
+            site->handle = other->handle;
+            return;
+        }
+    }
+    site->handle = ps_create_timer(site->name);
+}
+
+void ps_register_timer_site_(ps_timer_site_t * site) {
+    pthread_mutex_lock(&timer_site_mutex);
+    site->next = timer_sites[site->id % PS_TIMER_SITE_BUCKETS];
+    timer_sites[site->id % PS_TIMER_SITE_BUCKETS] = site;
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) {
+        ps_create_timer_site(site);
+    }
+    pthread_mutex_unlock(&timer_site_mutex);
+}
+
+/* Create the handles of the sites registered so far, then publish the
+ * initialization, so that no timer macro runs with a site that has no
+ * handle yet.  Sites registered later see the flag, as it is set with the
+ * mutex held. */
+static void ps_create_timer_sites(void) {
+    int i;
+    ps_timer_site_t * site;
+    pthread_mutex_lock(&timer_site_mutex);
+    for (i = 0 ; i < PS_TIMER_SITE_BUCKETS ; i++) {
+        for (site = timer_sites[i] ; site != NULL ; site = site->next) {
+            if (site->handle == NULL) {
+                ps_create_timer_site(site);
+            }
+        }
+    }
+    __atomic_store_n(&perfstubs_initialized, PERFSTUBS_SUCCESS,
+        __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&timer_site_mutex);
+}
+
+/* FNV-1a */
+static uint64_t ps_string_hash(const char * name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for ( ; *name != '\0' ; name++) {
+        hash = (hash ^ (unsigned char)(*name)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void ps_free_handle(void * handle) {
+    /* With one tool, the handle belongs to the tool */
+    if (num_tools_registered > 1) {
+        free(handle);
+    }
+}
+
+/* Find the entry for a name in the global table, adding it if needed.
+ * Returns NULL if the table is full or the handle can't be created. */
+static ps_string_entry_t * ps_intern_string(const char * name) {
+    uint64_t hash = ps_string_hash(name);
+    ps_string_entry_t * entry = NULL;
+    ps_string_entry_t * other;
+    size_t length;
+    int i;
+    for (i = 0 ; i < PS_STRING_PROBES ; i++) {
+        ps_string_entry_t ** slot =
+            &string_table[(hash + i) & (PS_STRING_TABLE_SIZE - 1)];
+        other = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (other == NULL) {
+            if (entry == NULL) {
+                length = strlen(name);
+                entry = (ps_string_entry_t *)malloc(
+                    sizeof(ps_string_entry_t) + length + 1);
+                if (entry == NULL) {
+                    return NULL;
+                }
+                entry->hash = hash;
+                memcpy(entry->name, name, length + 1);
+                entry->handle = ps_timer_create_(name);
+                if (entry->handle == NULL) {
+                    free(entry);
+                    return NULL;
+                }
+            }
+            if (__atomic_compare_exchange_n(slot, &other, entry, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return entry;
+            }
+            /* Another thread filled the slot first, check its name */
+        }
+        if (other->hash == hash && strcmp(other->name, name) == 0) {
+            if (entry != NULL) {
+                ps_free_handle(entry->handle);
+                free(entry);
+            }
+            return other;
+        }
+    }
+    if (entry != NULL) {
+        ps_free_handle(entry->handle);
+        free(entry);
+    }
+    return NULL;
+}
+
+static inline ps_string_entry_t * ps_find_string(const char * name) {
+#if defined(PERFSTUBS_HAVE_TLS)
+    ps_string_cache_t * cache = &string_cache[
+        (((uint64_t)(uintptr_t)name) * 0x9E3779B97F4A7C15ULL) >> 60];
+    if (cache->key == name && strcmp(cache->entry->name, name) == 0) {
+        return cache->entry;
+    }
+    ps_string_entry_t * entry = ps_intern_string(name);
+    if (entry != NULL) {
+        cache->key = name;
+        cache->entry = entry;
+    }
+    return entry;
+#else
+    return ps_intern_string(name);
+#endif
+}
+
+static void ps_register_thread_slow(void) {
+    int i;
+    if (perfstubs_initialized != PERFSTUBS_SUCCESS) {
+        return;
+    }
+    if (pthread_getspecific(key) == NULL) {
+        for (i = 0 ; i < num_tools_registered ; i++) {
+            if (tools[i].register_thread != NULL)
+                tools[i].register_thread();
+        }
+        pthread_setspecific(key, (void*)1UL);
+    }
+#if defined(PERFSTUBS_HAVE_TLS)
+    thread_seen = 1;
+#endif
+}
+
+static void ps_thread_exit(void * value) {
+    int i;
+    (void)(value);
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].deregister_thread != NULL)
+            tools[i].deregister_thread();
+    }
+}
+
 // used internally to the class
 static inline void ps_register_thread_internal(void) {
+#if defined(PERFSTUBS_HAVE_TLS)
+    if (thread_seen == 0) {
+        ps_register_thread_slow();
+    }
+#else
     if (pthread_getspecific(key) == NULL) {
-        if (register_thread_function != NULL) {
-            register_thread_function();
-            pthread_setspecific(key, (void*)1UL);
-        }
+        ps_register_thread_slow();
     }
+#endif
 }
 
 /* Initialization */
 void ps_initialize_(void) {
+    int i;
     /* Only do this once */
-    if (perfstubs_initialized != PERFSTUBS_UNKNOWN) {
+    if (perfstubs_initialized != PERFSTUBS_UNKNOWN || perfstubs_initializing) {
         return;
     }
+    perfstubs_initializing = 1;
     initialize_library();
-    if (initialize_function != NULL) {
-        initialize_function();
-        (void) pthread_once(&key_once, make_key);
-        pthread_setspecific(key, (void*)1UL);
+    if (perfstubs_initialized == PERFSTUBS_FAILURE) {
+        return;
+    }
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].initialize != NULL)
+            tools[i].initialize();
     }
+    (void) pthread_once(&key_once, make_key);
+    pthread_setspecific(key, (void*)1UL);
+#if defined(PERFSTUBS_HAVE_TLS)
+    thread_seen = 1;
+#endif
+    ps_create_timer_sites();
 }
 
 void ps_finalize_(void) {
-    if (finalize_function != NULL)
-        finalize_function();
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].finalize != NULL)
+            tools[i].finalize();
+    }
 }
 
 void ps_pause_measurement_(void) {
-    if (pause_measurement_function != NULL)
-        pause_measurement_function();
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].pause_measurement != NULL)
+            tools[i].pause_measurement();
+    }
 }
 
 void ps_resume_measurement_(void) {
-    if (resume_measurement_function != NULL)
-        resume_measurement_function();
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].resume_measurement != NULL)
+            tools[i].resume_measurement();
+    }
 }
 
 void ps_register_thread_(void) {
     ps_register_thread_internal();
 }
 
+/* Create the handle of a timer, once the tools are known */
+static void * ps_create_timer(const char *timer_name) {
+    void ** objects;
+    int i;
+    if (num_tools_registered == 1) {
+        if (tools[0].timer_create == NULL)
+            return NULL;
+        return tools[0].timer_create(timer_name);
+    }
+    objects = (void **)calloc(num_tools_registered, sizeof(void*));
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].timer_create != NULL)
+            objects[i] = tools[i].timer_create(timer_name);
+    }
+    return (void*)(objects);
+}
+
 void* ps_timer_create_(const char *timer_name) {
+    if (perfstubs_initialized != PERFSTUBS_SUCCESS)
+        return NULL;
     ps_register_thread_internal();
-    void ** objects = (void **)calloc(num_tools_registered, sizeof(void*));
-    if (timer_create_function != NULL)
-        objects = (void *)timer_create_function(timer_name);
-    return (void*)(objects);
+    return ps_create_timer(timer_name);
 }
 
 void ps_timer_create_fortran_(void ** object, const char *timer_name) {
     *object = ps_timer_create_(timer_name);
 }
 
-void ps_timer_start_(void *timer) {
+/* Tools that can't create a timer from its location are given the
+ * formatted name instead. */
+static void * ps_tool_create_location(ps_plugin_data_t * tool,
+        const char *file, const char *func, int line) {
+    char * name;
+    void * timer;
+    if (tool->timer_create_location != NULL)
+        return tool->timer_create_location(file, func, line);
+    if (tool->timer_create == NULL)
+        return NULL;
+    name = ps_make_timer_name_(file, func, line);
+    timer = tool->timer_create(name);
+    free(name);
+    return timer;
+}
+
+void* ps_timer_create_location_(const char *file, const char *func, int line) {
+    void ** objects;
+    int i;
+    if (perfstubs_initialized != PERFSTUBS_SUCCESS)
+        return NULL;
     ps_register_thread_internal();
-    void ** objects = (void **)timer;
-    if (timer_start_function != NULL && objects != NULL)
-        timer_start_function(objects);
+    if (num_tools_registered == 1)
+        return ps_tool_create_location(&tools[0], file, func, line);
+    objects = (void **)calloc(num_tools_registered, sizeof(void*));
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        objects[i] = ps_tool_create_location(&tools[i], file, func, line);
+    }
+    return (void*)(objects);
+}
+
+void ps_timer_start_(void *timer) {
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS && timer != NULL)
+        timer_start_function(timer);
 }
 
 void ps_timer_start_fortran_(void **timer) {
@@ -270,10 +698,8 @@ void ps_timer_start_fortran_(void **timer) {
 }
 
 void ps_timer_stop_(void *timer) {
-    void ** objects = (void **)timer;
-    if (timer_stop_function != NULL &&
-            objects != NULL)
-        timer_stop_function(objects);
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS && timer != NULL)
+        timer_stop_function(timer);
 }
 
 void ps_timer_stop_fortran_(void **timer) {
@@ -281,41 +707,82 @@ void ps_timer_stop_fortran_(void **timer) {
 }
 
 void ps_start_string_(const char *timer_name) {
+    ps_string_entry_t * entry;
+    int i;
     ps_register_thread_internal();
-    if (start_string_function != NULL)
-        start_string_function(timer_name);
+    if (string_cache_enabled &&
+            (entry = ps_find_string(timer_name)) != NULL) {
+        timer_start_function(entry->handle);
+        return;
+    }
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].start_string != NULL)
+            tools[i].start_string(timer_name);
+    }
 }
 
 void ps_stop_string_(const char *timer_name) {
-    if (stop_string_function != NULL)
-        stop_string_function(timer_name);
+    ps_string_entry_t * entry;
+    int i;
+    if (string_cache_enabled &&
+            (entry = ps_find_string(timer_name)) != NULL) {
+        timer_stop_function(entry->handle);
+        return;
+    }
+    for (i = num_tools_registered - 1 ; i >= 0 ; i--) {
+        if (tools[i].stop_string != NULL)
+            tools[i].stop_string(timer_name);
+    }
 }
 
 void ps_stop_current_(void) {
-    if (stop_current_function != NULL)
-        stop_current_function();
+    int i;
+    for (i = num_tools_registered - 1 ; i >= 0 ; i--) {
+        if (tools[i].stop_current != NULL)
+            tools[i].stop_current();
+    }
 }
 
 void ps_set_parameter_(const char * parameter_name, int64_t parameter_value) {
-    if (set_parameter_function != NULL)
-        set_parameter_function(parameter_name, parameter_value);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].set_parameter != NULL)
+            tools[i].set_parameter(parameter_name, parameter_value);
+    }
 }
 
 void ps_dynamic_phase_start_(const char *phase_prefix, int iteration_index) {
-    if (dynamic_phase_start_function != NULL)
-        dynamic_phase_start_function(phase_prefix, iteration_index);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].dynamic_phase_start != NULL)
+            tools[i].dynamic_phase_start(phase_prefix, iteration_index);
+    }
 }
 
 void ps_dynamic_phase_stop_(const char *phase_prefix, int iteration_index) {
-    if (dynamic_phase_stop_function != NULL)
-        dynamic_phase_stop_function(phase_prefix, iteration_index);
+    int i;
+    for (i = num_tools_registered - 1 ; i >= 0 ; i--) {
+        if (tools[i].dynamic_phase_stop != NULL)
+            tools[i].dynamic_phase_stop(phase_prefix, iteration_index);
+    }
 }
 
 void* ps_create_counter_(const char *name) {
+    void ** objects;
+    int i;
+    if (perfstubs_initialized != PERFSTUBS_SUCCESS)
+        return NULL;
     ps_register_thread_internal();
-    void ** objects = (void **)calloc(num_tools_registered, sizeof(void*));
-    if (create_counter_function != NULL)
-        objects = (void*)create_counter_function(name);
+    if (num_tools_registered == 1) {
+        if (tools[0].create_counter == NULL)
+            return NULL;
+        return tools[0].create_counter(name);
+    }
+    objects = (void **)calloc(num_tools_registered, sizeof(void*));
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].create_counter != NULL)
+            objects[i] = tools[i].create_counter(name);
+    }
     return (void*)(objects);
 }
 
@@ -324,10 +791,8 @@ void ps_create_counter_fortran_(void ** object, const char *name) {
 }
 
 void ps_sample_counter_(void *counter, const double value) {
-    void ** objects = (void **)counter;
-    if (sample_counter_function != NULL &&
-            objects != NULL)
-        sample_counter_function(objects, value);
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS && counter != NULL)
+        sample_counter_function(counter, value);
 }
 
 void ps_sample_counter_fortran_(void **counter, const double value) {
@@ -335,43 +800,161 @@ void ps_sample_counter_fortran_(void **counter, const double value) {
 }
 
 void ps_set_metadata_(const char *name, const char *value) {
+    int i;
     ps_register_thread_internal();
-    if (set_metadata_function != NULL)
-        set_metadata_function(name, value);
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].set_metadata != NULL)
+            tools[i].set_metadata(name, value);
+    }
+}
+
+void ps_set_sampling_(void *timer, unsigned int period) {
+    int i;
+    if (timer == NULL)
+        return;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].set_sampling != NULL)
+            tools[i].set_sampling(ps_tool_object(timer, i), period);
+    }
+}
+
+/* A token holds a single tool's instance, so intervals are only measured by
+ * the first tool that implements them. */
+static inline int ps_interval_tool(void) {
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].interval_begin != NULL && tools[i].interval_end != NULL)
+            return i;
+    }
+    return -1;
+}
+
+uint64_t ps_interval_begin_(void *timer) {
+    int i = ps_interval_tool();
+    if (timer == NULL || i < 0)
+        return 0;
+    return tools[i].interval_begin(ps_tool_object(timer, i));
+}
+
+void ps_interval_end_(uint64_t token) {
+    int i = ps_interval_tool();
+    if (token == 0 || i < 0)
+        return;
+    tools[i].interval_end(token);
 }
 
 void ps_dump_data_(void) {
-    if (dump_data_function != NULL)
-        dump_data_function();
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].dump_data != NULL)
+            tools[i].dump_data();
+    }
 }
 
+/* The data query API returns the data of the first tool that provides
+ * it.  The same tool is used to free the data. */
+
 void ps_get_timer_data_(ps_tool_timer_data_t *timer_data) {
-    if (get_timer_data_function != NULL)
-        get_timer_data_function(timer_data);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_timer_data != NULL) {
+            tools[i].get_timer_data(timer_data);
+            return;
+        }
+    }
 }
 
 void ps_get_counter_data_(ps_tool_counter_data_t *counter_data) {
-    if (get_counter_data_function != NULL)
-        get_counter_data_function(counter_data);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_counter_data != NULL) {
+            tools[i].get_counter_data(counter_data);
+            return;
+        }
+    }
+}
+
+void ps_get_timer_histogram_(ps_tool_histogram_data_t *histogram_data) {
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_timer_histogram != NULL) {
+            tools[i].get_timer_histogram(histogram_data);
+            return;
+        }
+    }
+}
+
+void ps_get_counter_histogram_(ps_tool_histogram_data_t *histogram_data) {
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_counter_histogram != NULL) {
+            tools[i].get_counter_histogram(histogram_data);
+            return;
+        }
+    }
 }
 
 void ps_get_metadata_(ps_tool_metadata_t *metadata) {
-    if (get_metadata_function != NULL)
-        get_metadata_function(metadata);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_metadata != NULL) {
+            tools[i].get_metadata(metadata);
+            return;
+        }
+    }
 }
 
 void ps_free_timer_data_(ps_tool_timer_data_t *timer_data) {
-    if (free_timer_data_function != NULL)
-        free_timer_data_function(timer_data);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_timer_data != NULL) {
+            if (tools[i].free_timer_data != NULL)
+                tools[i].free_timer_data(timer_data);
+            return;
+        }
+    }
 }
 
 void ps_free_counter_data_(ps_tool_counter_data_t *counter_data) {
-    if (free_counter_data_function != NULL)
-        free_counter_data_function(counter_data);
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_counter_data != NULL) {
+            if (tools[i].free_counter_data != NULL)
+                tools[i].free_counter_data(counter_data);
+            return;
+        }
+    }
 }
 
-void ps_free_metadata_(ps_tool_metadata_t *metadata) {
-    if (free_metadata_function != NULL)
-        free_metadata_function(metadata);
+void ps_free_timer_histogram_(ps_tool_histogram_data_t *histogram_data) {
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_timer_histogram != NULL) {
+            if (tools[i].free_histogram_data != NULL)
+                tools[i].free_histogram_data(histogram_data);
+            return;
+        }
+    }
 }
 
+void ps_free_counter_histogram_(ps_tool_histogram_data_t *histogram_data) {
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_counter_histogram != NULL) {
+            if (tools[i].free_histogram_data != NULL)
+                tools[i].free_histogram_data(histogram_data);
+            return;
+        }
+    }
+}
+
+void ps_free_metadata_(ps_tool_metadata_t *metadata) {
+    int i;
+    for (i = 0 ; i < num_tools_registered ; i++) {
+        if (tools[i].get_metadata != NULL) {
+            if (tools[i].free_metadata != NULL)
+                tools[i].free_metadata(metadata);
+            return;
+        }
+    }
+}
@@ -58,6 +58,7 @@ void  ps_register_thread_(void);
 void  ps_dump_data_(void);
 void* ps_timer_create_(const char *timer_name);
 void  ps_timer_create_fortran_(void ** object, const char *timer_name);
+void* ps_timer_create_location_(const char *file, const char *func, int line);
 void  ps_timer_start_(void *timer);
 void  ps_timer_start_fortran_(void **timer);
 void  ps_timer_stop_(void *timer);
@@ -73,6 +74,9 @@ void  ps_create_counter_fortran_(void ** object, const char *name);
 void  ps_sample_counter_(void *counter, const double value);
 void  ps_sample_counter_fortran_(void **counter, const double value);
 void  ps_set_metadata_(const char *name, const char *value);
+void  ps_set_sampling_(void *timer, unsigned int period);
+uint64_t ps_interval_begin_(void *timer);
+void  ps_interval_end_(uint64_t token);
 
 /* data query API */
 
@@ -82,9 +86,84 @@ void  ps_get_metadata_(ps_tool_metadata_t *metadata);
 void  ps_free_timer_data_(ps_tool_timer_data_t *timer_data);
 void  ps_free_counter_data_(ps_tool_counter_data_t *counter_data);
 void  ps_free_metadata_(ps_tool_metadata_t *metadata);
+void  ps_get_timer_histogram_(ps_tool_histogram_data_t *histogram_data);
+void  ps_get_counter_histogram_(ps_tool_histogram_data_t *histogram_data);
+void  ps_free_timer_histogram_(ps_tool_histogram_data_t *histogram_data);
+void  ps_free_counter_histogram_(ps_tool_histogram_data_t *histogram_data);
 
 char* ps_make_timer_name_(const char * file, const char * func, int line);
 
+/* A timer site is a statically allocated timer handle, registered once when
+ * the program (or shared object) is loaded.  The handle is created when
+ * PerfStubs is initialized, or immediately if it already is.  The id is a
+ * stable hash of the timer name and source location, computed at compile
+ * time, and sites with the same id share a handle. */
+typedef struct ps_timer_site
+{
+    uint64_t id;
+    const char *name;
+    void *handle;
+    struct ps_timer_site *next;
+} ps_timer_site_t;
+
+void  ps_register_timer_site_(ps_timer_site_t *site);
+
+/* The hot-path entries of the dispatch table.  The macros below call them
+ * directly, so that starting or stopping a timer is a single indirect call
+ * into the tool.  They are never NULL once perfstubs_initialized is
+ * PERFSTUBS_SUCCESS.  Threads are registered with the tool when they create
+ * a timer or counter, or call PERFSTUBS_REGISTER_THREAD(), not when they
+ * start a timer. */
+extern ps_timer_start_t timer_start_function;
+extern ps_timer_stop_t timer_stop_function;
+extern ps_sample_counter_t sample_counter_function;
+
+#if defined(PERFSTUBS_USE_STATIC) || defined(PERFSTUBS_STATIC_BINDING)
+#if defined(__clang__) && defined(__APPLE__)
+#define PS_WEAK_PRE
+#define PS_WEAK_POST __attribute__((weak_import))
+#define PS_WEAK_POST_NULL __attribute__((weak_import))
+#else
+#define PS_WEAK_PRE __attribute__((weak))
+#define PS_WEAK_POST
+#define PS_WEAK_POST_NULL
+#endif
+#endif
+
+#if defined(PERFSTUBS_STATIC_BINDING)
+/* With static binding, the macros call the tool functions by name instead
+ * of through the dispatch table, so that a statically linked tool can be
+ * inlined by link time optimization.  This assumes a single tool is linked
+ * into the executable.  If no tool is linked, the weak symbols are NULL. */
+PS_WEAK_PRE void ps_tool_timer_start(void *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_timer_stop(void *) PS_WEAK_POST;
+PS_WEAK_PRE void ps_tool_sample_counter(void *, double) PS_WEAK_POST;
+#endif
+
+static inline void ps_timer_start_inline_(void *timer) {
+#if defined(PERFSTUBS_STATIC_BINDING)
+    if (ps_tool_timer_start != NULL) ps_tool_timer_start(timer);
+#else
+    timer_start_function(timer);
+#endif
+}
+
+static inline void ps_timer_stop_inline_(void *timer) {
+#if defined(PERFSTUBS_STATIC_BINDING)
+    if (ps_tool_timer_stop != NULL) ps_tool_timer_stop(timer);
+#else
+    timer_stop_function(timer);
+#endif
+}
+
+static inline void ps_sample_counter_inline_(void *counter, double value) {
+#if defined(PERFSTUBS_STATIC_BINDING)
+    if (ps_tool_sample_counter != NULL) ps_tool_sample_counter(counter, value);
+#else
+    sample_counter_function(counter, value);
+#endif
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -106,17 +185,50 @@ char* ps_make_timer_name_(const char * file, const char * func, int line);
 
 #define PERFSTUBS_DUMP_DATA() ps_dump_data_();
 
+/* With C++17, and PERFSTUBS_STATIC_TIMERS defined before including this
+ * file, timers are identified at compile time.  Their handles are created
+ * at initialization from the table of registered timer sites, so starting
+ * them needs no static initialization guard, no NULL check and no string
+ * handling.  The timer names must then be constant expressions, so this is
+ * not the default. */
+#if defined(__cplusplus) && __cplusplus >= 201703L && \
+    defined(PERFSTUBS_STATIC_TIMERS)
+#define PERFSTUBS_STATIC_TIMER_SITES
+#endif
+
+#if defined(PERFSTUBS_STATIC_TIMER_SITES)
+
+#define PERFSTUBS_TIMER_SITE(_site, _timer_name) \
+    static constexpr const char * CONCAT(_site,_name) = _timer_name; \
+    struct _site { \
+        static constexpr const char * name() { return CONCAT(_site,_name); } \
+        static constexpr uint64_t id() { \
+            return PSNS::site_id(name(), __FILE__, __LINE__); \
+        } \
+    };
+
+#define PERFSTUBS_TIMER_START(_timer, _timer_name) \
+    PERFSTUBS_TIMER_SITE(CONCAT(__ps_site,__LINE__), _timer_name) \
+    void * _timer = PSNS::StaticTimer<CONCAT(__ps_site,__LINE__)>::handle(); \
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) { \
+        ps_timer_start_inline_(_timer); \
+    };
+
+#else
+
 #define PERFSTUBS_TIMER_START(_timer, _timer_name) \
     static void * _timer = NULL; \
     if (perfstubs_initialized == PERFSTUBS_SUCCESS) { \
         if (_timer == NULL) { \
             _timer = ps_timer_create_(_timer_name); \
         } \
-        ps_timer_start_(_timer); \
+        ps_timer_start_inline_(_timer); \
     };
 
+#endif // defined(PERFSTUBS_STATIC_TIMER_SITES)
+
 #define PERFSTUBS_TIMER_STOP(_timer) \
-    if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_stop_(_timer); \
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_stop_inline_(_timer); \
 
 #define PERFSTUBS_START_STRING(_timer_name) \
     if (perfstubs_initialized == PERFSTUBS_SUCCESS) { \
@@ -146,16 +258,14 @@ char* ps_make_timer_name_(const char * file, const char * func, int line);
     static void * _timer = NULL; \
     if (perfstubs_initialized == PERFSTUBS_SUCCESS) { \
         if (_timer == NULL) { \
-            char * tmpstr = ps_make_timer_name_(__FILE__, \
+            _timer = ps_timer_create_location_(__FILE__, \
             __PERFSTUBS_FUNCTION__, __LINE__); \
-            _timer = ps_timer_create_(tmpstr); \
-            free(tmpstr); \
         } \
-        ps_timer_start_(_timer); \
+        ps_timer_start_inline_(_timer); \
     };
 
 #define PERFSTUBS_TIMER_STOP_FUNC(_timer) \
-    if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_stop_(_timer);
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_stop_inline_(_timer);
 
 #define PERFSTUBS_SAMPLE_COUNTER(_name, _value) \
     static void * CONCAT(__var,__LINE__) =  NULL; \
@@ -163,12 +273,30 @@ char* ps_make_timer_name_(const char * file, const char * func, int line);
         if (CONCAT(__var,__LINE__) == NULL) { \
             CONCAT(__var,__LINE__) = ps_create_counter_(_name); \
         } \
-        ps_sample_counter_(CONCAT(__var,__LINE__), _value); \
+        ps_sample_counter_inline_(CONCAT(__var,__LINE__), _value); \
     };
 
 #define PERFSTUBS_METADATA(_name, _value) \
     if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_set_metadata_(_name, _value);
 
+/* Ask the tool to measure only 1 out of every _period start/stop pairs of
+ * _timer, and extrapolate.  A period of 0 or 1 measures every call. */
+#define PERFSTUBS_SET_SAMPLING(_timer, _period) \
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_set_sampling_(_timer, _period);
+
+/* Time an interval of _timer that doesn't nest with the other timers of the
+ * thread, such as a task that may migrate to another thread, or one of
+ * several overlapping asynchronous operations.  _token is a uint64_t lvalue
+ * that identifies the interval; it can be passed to
+ * PERFSTUBS_INTERVAL_END() on any thread, once.  A token of 0 (when there
+ * is no tool) is ignored. */
+#define PERFSTUBS_INTERVAL_BEGIN(_token, _timer) \
+    _token = (perfstubs_initialized == PERFSTUBS_SUCCESS) ? \
+        ps_interval_begin_(_timer) : 0;
+
+#define PERFSTUBS_INTERVAL_END(_token) \
+    if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_interval_end_(_token);
+
 #else // defined(PERFSTUBS_USE_TIMERS)
 
 #define PERFSTUBS_INITIALIZE()
@@ -189,6 +317,9 @@ char* ps_make_timer_name_(const char * file, const char * func, int line);
 #define PERFSTUBS_TIMER_STOP_FUNC(_timer)
 #define PERFSTUBS_SAMPLE_COUNTER(_name, _value)
 #define PERFSTUBS_METADATA(_name, _value)
+#define PERFSTUBS_SET_SAMPLING(_timer, _period)
+#define PERFSTUBS_INTERVAL_BEGIN(_token, _timer) _token = 0;
+#define PERFSTUBS_INTERVAL_END(_token)
 
 #endif // defined(PERFSTUBS_USE_TIMERS)
 
@@ -213,6 +344,10 @@ char* ps_make_timer_name_(const char * file, const char * func, int line);
 #include <memory>
 #include <sstream>
 #include <string>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <utility>
+#endif
 
 namespace external
 {
@@ -228,37 +363,215 @@ private:
 public:
     ScopedTimer(void * timer) : m_timer(timer)
     {
-        if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_start_(m_timer);
+        if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_start_inline_(m_timer);
     }
     ~ScopedTimer()
     {
-        if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_stop_(m_timer);
+        if (perfstubs_initialized == PERFSTUBS_SUCCESS) ps_timer_stop_inline_(m_timer);
+    }
+};
+
+#if defined(__cpp_impl_coroutine)
+
+/*
+ * Times the running part of a coroutine.  A ScopedTimer held across a
+ * co_await counts the time spent suspended, and breaks the nesting of the
+ * timers of the thread if the coroutine is resumed on another one.  A
+ * CoroutineTimer times each stretch between suspensions as an interval
+ * (see PERFSTUBS_INTERVAL_BEGIN), which the awaits wrapped by await() end
+ * before suspending and begin again on resumption, on whatever thread that
+ * is.
+ */
+class CoroutineTimer
+{
+private:
+    void * m_timer;
+    uint64_t m_token;
+
+    /* The awaiter of an awaitable, found as co_await finds it */
+    template <typename Awaitable>
+    static auto awaiter(Awaitable &&a, int)
+        -> decltype(std::forward<Awaitable>(a).operator co_await())
+    {
+        return std::forward<Awaitable>(a).operator co_await();
+    }
+    template <typename Awaitable>
+    static auto awaiter(Awaitable &&a, long)
+        -> decltype(operator co_await(std::forward<Awaitable>(a)))
+    {
+        return operator co_await(std::forward<Awaitable>(a));
+    }
+    template <typename Awaitable>
+    static Awaitable &&awaiter(Awaitable &&a, ...)
+    {
+        return std::forward<Awaitable>(a);
+    }
+
+    /* A temporary of the co_await expression, so it lives until the
+     * coroutine is resumed, as does an awaitable it refers to */
+    template <typename Awaitable>
+    class TimedAwaiter
+    {
+    private:
+        CoroutineTimer &m_owner;
+        decltype(awaiter(std::declval<Awaitable>(), 0)) m_awaiter;
+
+    public:
+        TimedAwaiter(CoroutineTimer &owner, Awaitable &&a)
+            : m_owner(owner), m_awaiter(awaiter(std::forward<Awaitable>(a), 0))
+        {
+        }
+        bool await_ready() { return m_awaiter.await_ready(); }
+        /* Once the wrapped awaiter has the handle, the coroutine may
+         * already be running on another thread, so nothing is done after
+         * it returns */
+        template <typename Promise>
+        decltype(auto) await_suspend(std::coroutine_handle<Promise> handle)
+        {
+            m_owner.suspend();
+            try
+            {
+                return m_awaiter.await_suspend(handle);
+            }
+            catch (...)
+            {
+                m_owner.resume();
+                throw;
+            }
+        }
+        decltype(auto) await_resume()
+        {
+            m_owner.resume();
+            return m_awaiter.await_resume();
+        }
+    };
+
+public:
+    CoroutineTimer(void * timer) : m_timer(timer), m_token(0) { resume(); }
+    ~CoroutineTimer() { suspend(); }
+    CoroutineTimer(const CoroutineTimer &) = delete;
+    CoroutineTimer &operator=(const CoroutineTimer &) = delete;
+
+    /* Wraps an awaitable, as in co_await timer.await(socket.read(buffer)) */
+    template <typename Awaitable>
+    TimedAwaiter<Awaitable> await(Awaitable &&a)
+    {
+        return TimedAwaiter<Awaitable>(*this, std::forward<Awaitable>(a));
+    }
+    void suspend()
+    {
+        if (m_token != 0 && perfstubs_initialized == PERFSTUBS_SUCCESS)
+            ps_interval_end_(m_token);
+        m_token = 0;
+    }
+    void resume()
+    {
+        if (m_token == 0 && perfstubs_initialized == PERFSTUBS_SUCCESS)
+            m_token = ps_interval_begin_(m_timer);
     }
 };
 
+#endif // defined(__cpp_impl_coroutine)
+
+#if defined(PERFSTUBS_STATIC_TIMER_SITES)
+
+/* FNV-1a, evaluated at compile time for timer site ids */
+constexpr uint64_t site_hash(const char *str,
+                             uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    while (*str != '\0')
+    {
+        hash = (hash ^ (uint64_t)(unsigned char)(*str++)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+constexpr uint64_t site_id(const char *name, const char *file, int line)
+{
+    return (site_hash(file, site_hash(name)) ^ (uint64_t)line) *
+           0x100000001b3ULL;
+}
+
+/*
+ * One instance per timer site.  The Site type is a local class declared by
+ * the timer macros, providing constexpr name() and id() functions, so the
+ * site data is constant initialized and the registrar runs when the
+ * program or shared object is loaded.
+ */
+template <typename Site>
+class StaticTimer
+{
+private:
+    struct Registrar
+    {
+        Registrar() { ps_register_timer_site_(&site); }
+    };
+    static ps_timer_site_t site;
+    static Registrar registrar;
+
+public:
+    static void * handle()
+    {
+        /* referencing the registrar makes sure it is instantiated */
+        (void)&registrar;
+        return site.handle;
+    }
+};
+
+template <typename Site>
+ps_timer_site_t StaticTimer<Site>::site = {Site::id(), Site::name(), nullptr,
+                                           nullptr};
+
+template <typename Site>
+typename StaticTimer<Site>::Registrar StaticTimer<Site>::registrar;
+
+#endif // defined(PERFSTUBS_STATIC_TIMER_SITES)
+
 } // namespace PERFSTUBS_INTERNAL_NAMESPACE
 
 } // namespace external
 
 namespace PSNS = external::PERFSTUBS_INTERNAL_NAMESPACE;
 
+#if defined(PERFSTUBS_STATIC_TIMER_SITES)
+
+#define PERFSTUBS_SCOPED_TIMER(__name) \
+    PERFSTUBS_TIMER_SITE(CONCAT(__ps_site,__LINE__), __name) \
+    PSNS::ScopedTimer CONCAT(__var2,__LINE__)( \
+        PSNS::StaticTimer<CONCAT(__ps_site,__LINE__)>::handle());
+
+#else
+
 #define PERFSTUBS_SCOPED_TIMER(__name) \
     static void * CONCAT(__var,__LINE__) = ps_timer_create_(__name); \
     PSNS::ScopedTimer CONCAT(__var2,__LINE__)(CONCAT(__var,__LINE__));
 
-/* The string created by ps_make_timer_name is a memory leak, but
- * it is only created once per function, since it is called when the
- * static variable is first initialized. */
+#endif // defined(PERFSTUBS_STATIC_TIMER_SITES)
+
+/* The name is built from the location by the tool, when it is needed. */
 #define PERFSTUBS_SCOPED_TIMER_FUNC() \
     static void * CONCAT(__var,__LINE__) = \
-        ps_timer_create_(ps_make_timer_name_(__FILE__, \
-        __PERFSTUBS_FUNCTION__, __LINE__)); \
+        ps_timer_create_location_(__FILE__, __PERFSTUBS_FUNCTION__, __LINE__); \
     PSNS::ScopedTimer CONCAT(__var2,__LINE__)(CONCAT(__var,__LINE__));
 
+#if defined(__cpp_impl_coroutine)
+
+/* Times the body of a coroutine, from here to the end of the scope, leaving
+ * out the time it spends suspended in PERFSTUBS_CO_AWAIT() */
+#define PERFSTUBS_COROUTINE_TIMER(_var, __name) \
+    static void * CONCAT(__var,__LINE__) = ps_timer_create_(__name); \
+    PSNS::CoroutineTimer _var(CONCAT(__var,__LINE__));
+
+#define PERFSTUBS_CO_AWAIT(_var, _awaitable) co_await (_var).await(_awaitable)
+
+#endif // defined(__cpp_impl_coroutine)
+
 #else // defined(PERFSTUBS_USE_TIMERS)
 
 #define PERFSTUBS_SCOPED_TIMER(__name)
 #define PERFSTUBS_SCOPED_TIMER_FUNC()
+#define PERFSTUBS_COROUTINE_TIMER(_var, __name)
+#define PERFSTUBS_CO_AWAIT(_var, _awaitable) co_await (_awaitable)
 
 #endif // defined(PERFSTUBS_USE_TIMERS)
 
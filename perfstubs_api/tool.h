@@ -31,6 +31,22 @@ typedef struct ps_tool_counter_data
     double *value_sumsqr;
 } ps_tool_counter_data_t;
 
+/* Histograms of the durations of timers (in seconds) or of the values of
+ * counters.  All the histograms share the same buckets: bucket b counts
+ * the events in [bucket_lower[b], bucket_upper[b]).  The counts are
+ * ordered by timer (or counter), then thread, then bucket, and can be
+ * summed over threads to merge them. */
+typedef struct ps_tool_histogram_data
+{
+    unsigned int num_histograms;
+    unsigned int num_threads;
+    unsigned int num_buckets;
+    char **names;
+    double *bucket_lower;
+    double *bucket_upper;
+    double *counts;
+} ps_tool_histogram_data_t;
+
 typedef struct ps_tool_metadata
 {
     unsigned int num_values;
@@ -48,6 +64,7 @@ typedef void  (*ps_finalize_t)(void);
 typedef void  (*ps_pause_measurement_t)(void);
 typedef void  (*ps_resume_measurement_t)(void);
 typedef void  (*ps_register_thread_t)(void);
+typedef void  (*ps_deregister_thread_t)(void);
 typedef void  (*ps_dump_data_t)(void);
 /* Simple functions */
 typedef void  (*ps_start_string_t)(const char *);
@@ -55,6 +72,7 @@ typedef void  (*ps_stop_string_t)(const char *);
 typedef void  (*ps_stop_current_t)(void);
 /* Data entry functions */
 typedef void* (*ps_timer_create_t)(const char *);
+typedef void* (*ps_timer_create_location_t)(const char *, const char *, int);
 typedef void  (*ps_timer_start_t)(void *);
 typedef void  (*ps_timer_stop_t)(void *);
 typedef void  (*ps_set_parameter_t)(const char *, int64_t);
@@ -63,6 +81,9 @@ typedef void  (*ps_dynamic_phase_stop_t)(const char *, int);
 typedef void* (*ps_create_counter_t)(const char *);
 typedef void  (*ps_sample_counter_t)(void *, double);
 typedef void  (*ps_set_metadata_t)(const char *, const char *);
+typedef void  (*ps_set_sampling_t)(void *, unsigned int);
+typedef uint64_t (*ps_interval_begin_t)(void *);
+typedef void  (*ps_interval_end_t)(uint64_t);
 /* Data Query Functions */
 typedef void  (*ps_get_timer_data_t)(ps_tool_timer_data_t *);
 typedef void  (*ps_get_counter_data_t)(ps_tool_counter_data_t *);
@@ -70,6 +91,9 @@ typedef void  (*ps_get_metadata_t)(ps_tool_metadata_t *);
 typedef void  (*ps_free_timer_data_t)(ps_tool_timer_data_t *);
 typedef void  (*ps_free_counter_data_t)(ps_tool_counter_data_t *);
 typedef void  (*ps_free_metadata_t)(ps_tool_metadata_t *);
+typedef void  (*ps_get_timer_histogram_t)(ps_tool_histogram_data_t *);
+typedef void  (*ps_get_counter_histogram_t)(ps_tool_histogram_data_t *);
+typedef void  (*ps_free_histogram_data_t)(ps_tool_histogram_data_t *);
 
 /****************************************************************************/
 /* Declare the structure used to register a tool */
@@ -105,6 +129,25 @@ typedef struct ps_plugin_data {
     ps_free_timer_data_t free_timer_data;
     ps_free_counter_data_t free_counter_data;
     ps_free_metadata_t free_metadata;
+    /* Called on a registered thread when it exits */
+    ps_deregister_thread_t deregister_thread;
+    /* Measure only 1 out of every N start/stop pairs of a timer */
+    ps_set_sampling_t set_sampling;
+    /* Create a timer from the file, function and line of the code it
+     * measures.  The strings are string literals (or __func__), so they
+     * stay valid and the tool can format the name only when it needs it. */
+    ps_timer_create_location_t timer_create_location;
+    /* Distributions of the timer durations and counter values */
+    ps_get_timer_histogram_t get_timer_histogram;
+    ps_get_counter_histogram_t get_counter_histogram;
+    ps_free_histogram_data_t free_histogram_data;
+    /* Time an instance of a timer that isn't on the thread's stack.  The
+     * tool returns a nonzero token from interval_begin, which identifies
+     * the instance when it is passed to interval_end, possibly from another
+     * thread.  Both may be called concurrently from any number of threads,
+     * and must not block. */
+    ps_interval_begin_t interval_begin;
+    ps_interval_end_t interval_end;
 } ps_plugin_data_t;
 
 /****************************************************************************/
@@ -0,0 +1,54 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+/* A tool that does nothing, for measuring the cost of the dispatch layer
+ * itself.  It is found by its ps_tool_* symbols, so it can't be linked
+ * into the same executable as tool one. */
+
+#include "perfstubs_api/tool.h"
+
+namespace external {
+    namespace ps_null_implementation {
+        /* Handles only need to be unique and not NULL */
+        char timer_handle;
+        char counter_handle;
+    }
+}
+
+namespace MINE = external::ps_null_implementation;
+
+extern "C"
+{
+    void ps_tool_initialize(void) { }
+
+    void ps_tool_finalize(void) { }
+
+    void ps_tool_register_thread(void) { }
+
+    void * ps_tool_timer_create(const char * timer_name)
+    {
+        (void)(timer_name);
+        return &MINE::timer_handle;
+    }
+
+    void ps_tool_timer_start(void * timer) { (void)(timer); }
+
+    void ps_tool_timer_stop(void * timer) { (void)(timer); }
+
+    void ps_tool_start_string(const char * timer_name) { (void)(timer_name); }
+
+    void ps_tool_stop_string(const char * timer_name) { (void)(timer_name); }
+
+    void * ps_tool_create_counter(const char * counter_name)
+    {
+        (void)(counter_name);
+        return &MINE::counter_handle;
+    }
+
+    void ps_tool_sample_counter(void * counter, double value)
+    {
+        (void)(counter);
+        (void)(value);
+    }
+}
@@ -0,0 +1,207 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+/* Converts a binary profile written by the reference tool (with
+ * PS_TOOL_PROFILE=binary) to CSV or JSON.
+ *
+ * Usage: perfstubs-profile [options] <profile>
+ *   -f csv|json  output format (default csv)
+ *   -c           with csv, write the counters rather than the timers
+ *
+ * The CSV output has one row per timer (or counter) and thread, leaving out
+ * the threads that never started the timer or sampled the counter.  The
+ * JSON output holds the timers and the counters, with the values of every
+ * thread. */
+
+#include "tool1_profile.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace MINE = external::ps_implementation;
+
+static const char * counter_columns[MINE::profile_counter_columns] = {
+    "Samples", "Total", "Min", "Max", "SumSqr"};
+
+/* Quoted only if needed, as location timer names hold commas */
+void csv_string(const char * s) {
+    if (strpbrk(s, ",\"\n") == nullptr) {
+        fputs(s, stdout);
+        return;
+    }
+    putchar('"');
+    for ( ; *s != '\0' ; s++) {
+        if (*s == '"') {
+            putchar('"');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+void json_string(const char * s) {
+    putchar('"');
+    for ( ; *s != '\0' ; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/* JSON has no infinities or NaN */
+void json_number(double value) {
+    if (std::isfinite(value)) {
+        printf("%.17g", value);
+    } else {
+        printf("null");
+    }
+}
+
+void write_csv_timers(const ps_tool_timer_data_t& timers) {
+    printf("Timer,Thread");
+    for (unsigned int m = 0 ; m < timers.num_metrics ; m++) {
+        putchar(',');
+        csv_string(timers.metric_names[m]);
+    }
+    putchar('\n');
+    for (unsigned int i = 0 ; i < timers.num_timers ; i++) {
+        for (unsigned int t = 0 ; t < timers.num_threads ; t++) {
+            const double * v = timers.values +
+                ((size_t)i * timers.num_threads + t) * timers.num_metrics;
+            /* the first metric is the number of calls */
+            if (timers.num_metrics == 0 || v[0] == 0.0) {
+                continue;
+            }
+            csv_string(timers.timer_names[i]);
+            printf(",%u", t);
+            for (unsigned int m = 0 ; m < timers.num_metrics ; m++) {
+                printf(",%.17g", v[m]);
+            }
+            putchar('\n');
+        }
+    }
+}
+
+void write_csv_counters(const ps_tool_counter_data_t& counters) {
+    const double * columns[MINE::profile_counter_columns] = {
+        counters.num_samples, counters.value_total, counters.value_min,
+        counters.value_max, counters.value_sumsqr};
+    printf("Counter,Thread");
+    for (uint32_t c = 0 ; c < MINE::profile_counter_columns ; c++) {
+        printf(",%s", counter_columns[c]);
+    }
+    putchar('\n');
+    for (unsigned int i = 0 ; i < counters.num_counters ; i++) {
+        for (unsigned int t = 0 ; t < counters.num_threads ; t++) {
+            size_t index = (size_t)i * counters.num_threads + t;
+            if (counters.num_samples[index] == 0.0) {
+                continue;
+            }
+            csv_string(counters.counter_names[i]);
+            printf(",%u", t);
+            for (uint32_t c = 0 ; c < MINE::profile_counter_columns ; c++) {
+                printf(",%.17g", columns[c][index]);
+            }
+            putchar('\n');
+        }
+    }
+}
+
+void write_json(const MINE::profile_header& header,
+    const ps_tool_timer_data_t& timers,
+    const ps_tool_counter_data_t& counters) {
+    printf("{\"pid\": %llu, \"threads\": %u,\n \"metrics\": [",
+        (unsigned long long)header.pid, timers.num_threads);
+    for (unsigned int m = 0 ; m < timers.num_metrics ; m++) {
+        printf(m == 0 ? "" : ", ");
+        json_string(timers.metric_names[m]);
+    }
+    printf("],\n \"timers\": [");
+    for (unsigned int i = 0 ; i < timers.num_timers ; i++) {
+        printf(i == 0 ? "\n  {\"name\": " : ",\n  {\"name\": ");
+        json_string(timers.timer_names[i]);
+        printf(", \"values\": [");
+        for (unsigned int t = 0 ; t < timers.num_threads ; t++) {
+            const double * v = timers.values +
+                ((size_t)i * timers.num_threads + t) * timers.num_metrics;
+            printf(t == 0 ? "[" : ", [");
+            for (unsigned int m = 0 ; m < timers.num_metrics ; m++) {
+                printf(m == 0 ? "" : ", ");
+                json_number(v[m]);
+            }
+            printf("]");
+        }
+        printf("]}");
+    }
+    printf("],\n \"counters\": [");
+    const double * columns[MINE::profile_counter_columns] = {
+        counters.num_samples, counters.value_total, counters.value_min,
+        counters.value_max, counters.value_sumsqr};
+    for (unsigned int i = 0 ; i < counters.num_counters ; i++) {
+        printf(i == 0 ? "\n  {\"name\": " : ",\n  {\"name\": ");
+        json_string(counters.counter_names[i]);
+        for (uint32_t c = 0 ; c < MINE::profile_counter_columns ; c++) {
+            printf(", \"%s\": [", counter_columns[c]);
+            for (unsigned int t = 0 ; t < counters.num_threads ; t++) {
+                printf(t == 0 ? "" : ", ");
+                json_number(columns[c][(size_t)i * counters.num_threads + t]);
+            }
+            printf("]");
+        }
+        printf("}");
+    }
+    printf("]}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    bool json = false;
+    bool counters = false;
+    const char * path = nullptr;
+    for (int i = 1 ; i < argc ; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "json") == 0) {
+                json = true;
+            } else if (strcmp(argv[i], "csv") != 0) {
+                fprintf(stderr, "Unknown format %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0) {
+            counters = true;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == nullptr) {
+        fprintf(stderr, "Usage: %s [-f csv|json] [-c] <profile>\n", argv[0]);
+        return 1;
+    }
+    MINE::profile_header header;
+    ps_tool_timer_data_t timer_data;
+    ps_tool_counter_data_t counter_data;
+    if (!MINE::profile_read(path, &header, &timer_data, &counter_data)) {
+        fprintf(stderr, "%s is not a readable profile\n", path);
+        return 1;
+    }
+    if (json) {
+        write_json(header, timer_data, counter_data);
+    } else if (counters) {
+        write_csv_counters(counter_data);
+    } else {
+        write_csv_timers(timer_data);
+    }
+    MINE::profile_free(&timer_data, &counter_data);
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+/* Shows the hottest timers of a process running with the reference tool and
+ * PS_TOOL_SHM=1, from the profile the tool exports in shared memory.
+ *
+ * Usage: perfstubs-top [options] <pid or region name>
+ *   -i <seconds>  time between updates (default 1)
+ *   -n <count>    exit after this many updates (default: when the process
+ *                 exits)
+ *   -k <timers>   number of timers shown (default 20)
+ *   -r            remove the region when done, for a region that was kept
+ *                 after the process exited (PS_TOOL_SHM_KEEP=1)
+ *
+ * The first update shows the totals since the process started, the next
+ * ones the calls and time of each interval, summed over the threads. */
+
+#include "tool1_shm.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+
+namespace MINE = external::ps_implementation;
+
+struct options {
+    double interval{1.0};
+    long count{0};
+    size_t top{20};
+    bool remove{false};
+    const char * target{nullptr};
+};
+
+struct row {
+    uint32_t timer;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+};
+
+/* Sum the slots of every timer over the threads.  A timer with a slot that
+ * can't be read consistently is marked stale.  The numbers of timers and
+ * threads are bounded by the size of the region. */
+std::vector<MINE::shm_values> read_totals(MINE::shm_region& region,
+    std::vector<bool>& stale) {
+    uint32_t num_timers = region.num_timers();
+    uint32_t num_threads = region.num_threads();
+    std::vector<MINE::shm_values> totals(num_timers);
+    stale.assign(num_timers, false);
+    for (uint32_t i = 0 ; i < num_timers ; i++) {
+        memset(&totals[i], 0, sizeof(MINE::shm_values));
+        for (uint32_t t = 0 ; t < num_threads ; t++) {
+            MINE::shm_values v;
+            if (!region.read(i, t, v)) {
+                stale[i] = true;
+                continue;
+            }
+            totals[i].calls += v.calls;
+            totals[i].inclusive += v.inclusive;
+            totals[i].exclusive += v.exclusive;
+        }
+    }
+    return totals;
+}
+
+void show(MINE::shm_region& region, const std::vector<row>& rows,
+    size_t stale, const options& opts, bool clear) {
+    MINE::shm_header * header = region.header();
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+    printf("perfstubs-top: pid %llu, %u timers, %u threads, update %llu\n",
+        (unsigned long long)header->pid, region.num_timers(),
+        region.num_threads(),
+        (unsigned long long)header->updates.load(std::memory_order_acquire));
+    if (stale > 0) {
+        printf("%zu timers not updated: the region is inconsistent\n", stale);
+    }
+    printf("     Calls   Exclusive(s)   Inclusive(s)  Name\n");
+    for (size_t i = 0 ; i < rows.size() && i < opts.top ; i++) {
+        /* the name may not be terminated in a corrupt region */
+        printf("%10llu %14.6f %14.6f  %.*s\n",
+            (unsigned long long)rows[i].calls, rows[i].exclusive * 1.0e-9,
+            rows[i].inclusive * 1.0e-9, (int)MINE::shm_name_size,
+            region.names()[rows[i].timer].name);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+    for (int i = 1 ; i < argc ; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            opts.remove = true;
+        } else if (argv[i][0] == '-' && i + 1 < argc) {
+            if (strcmp(argv[i], "-i") == 0) {
+                opts.interval = strtod(argv[i+1], nullptr);
+            } else if (strcmp(argv[i], "-n") == 0) {
+                opts.count = strtol(argv[i+1], nullptr, 10);
+            } else if (strcmp(argv[i], "-k") == 0) {
+                opts.top = strtoul(argv[i+1], nullptr, 10);
+            } else {
+                fprintf(stderr, "Unknown option %s\n", argv[i]);
+                return 1;
+            }
+            i++;
+        } else {
+            opts.target = argv[i];
+        }
+    }
+    if (opts.target == nullptr || opts.interval <= 0.0) {
+        fprintf(stderr, "Usage: %s [-i seconds] [-n count] [-k timers] [-r] "
+            "<pid or region name>\n", argv[0]);
+        return 1;
+    }
+    /* A pid is the name the tool uses by default */
+    std::string name(opts.target);
+    if (strspn(opts.target, "0123456789") == name.size()) {
+        name = MINE::shm_default_name(strtoull(opts.target, nullptr, 10));
+    }
+    MINE::shm_region * region = MINE::shm_region::attach(name);
+    if (region == nullptr) {
+        fprintf(stderr, "Unable to attach to /dev/shm/%s\n", name.c_str());
+        return 1;
+    }
+
+    bool clear = opts.count == 0 && isatty(STDOUT_FILENO);
+    std::vector<MINE::shm_values> previous;
+    for (long n = 0 ; opts.count == 0 || n < opts.count ; n++) {
+        if (n > 0) {
+            std::this_thread::sleep_for(
+                std::chrono::duration<double>(opts.interval));
+        }
+        if (!region->check()) {
+            fprintf(stderr, "/dev/shm/%s was truncated or replaced\n",
+                name.c_str());
+            break;
+        }
+        std::vector<bool> stale;
+        std::vector<MINE::shm_values> totals = read_totals(*region, stale);
+        std::vector<row> rows;
+        size_t num_stale = 0;
+        for (uint32_t i = 0 ; i < totals.size() ; i++) {
+            /* keep the last values read of a stale timer */
+            if (stale[i]) {
+                num_stale++;
+                if (i < previous.size()) {
+                    totals[i] = previous[i];
+                }
+                continue;
+            }
+            row r = {i, totals[i].calls, totals[i].inclusive,
+                totals[i].exclusive};
+            if (i < previous.size()) {
+                r.calls -= previous[i].calls;
+                r.inclusive -= previous[i].inclusive;
+                r.exclusive -= previous[i].exclusive;
+            }
+            if (r.calls > 0 || r.exclusive > 0) {
+                rows.push_back(r);
+            }
+        }
+        std::stable_sort(rows.begin(), rows.end(),
+            [](const row& a, const row& b) {
+                return a.exclusive > b.exclusive;
+            });
+        show(*region, rows, num_stale, opts, clear);
+        previous = totals;
+        /* Stop when the process is gone */
+        if (kill((pid_t)region->header()->pid, 0) != 0 && errno == ESRCH) {
+            break;
+        }
+    }
+    if (opts.remove) {
+        region->unlink();
+    }
+    delete region;
+    return 0;
+}
@@ -0,0 +1,228 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+/* Converts a trace written by the reference tool (with PS_TOOL_TRACE=1) to
+ * the Chrome trace event format, which Perfetto UI and chrome://tracing
+ * open.
+ *
+ * Usage: perfstubs-trace <trace> [output]
+ *
+ * Timers become slices on the track of their thread, dynamic phases become
+ * slices named "<prefix> <iteration>" around them, and counters become
+ * counter tracks.  The JSON is written to the output file, or to the
+ * standard output.
+ *
+ * The trace is read twice: once to find the name tables, which the tool
+ * writes at the end, and the event blocks, then once more to convert the
+ * events a block at a time.  The memory used depends on the number of
+ * names and blocks, not on the number of events. */
+
+#include "tool1_trace.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace MINE = external::ps_implementation;
+
+struct event_block {
+    off_t offset; /* of the first record */
+    uint32_t thread;
+    uint64_t count;
+};
+
+struct trace_index {
+    std::vector<std::string> names[3]; /* timers, counters, phases */
+    std::vector<event_block> blocks;
+    std::set<uint32_t> threads;
+    uint64_t first{UINT64_MAX};
+};
+
+/* The name, escaped for JSON */
+std::string escape(const std::string& name) {
+    std::string out;
+    char code[8];
+    for (unsigned char c : name) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += (char)c;
+        }
+    }
+    return out;
+}
+
+const std::string& name(trace_index& index, int table, uint32_t id) {
+    std::vector<std::string>& names = index.names[table];
+    if (id >= names.size()) {
+        names.resize(id + 1);
+    }
+    /* a trace that was not finalized has no names */
+    if (names[id].empty()) {
+        static const char * kinds[3] = {"timer", "counter", "phase"};
+        names[id] = std::string(kinds[table]) + " " + std::to_string(id);
+    }
+    return names[id];
+}
+
+/* Find the name tables and the event blocks, stopping at a truncated
+ * block */
+bool read_index(FILE * in, trace_index& index) {
+    MINE::trace_file_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        strncmp(header.magic, "PSTRACE", sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(MINE::trace_record)) {
+        return false;
+    }
+    /* seeking past the end of a file succeeds, so the size of an event
+     * block is checked against the size of the file */
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0) {
+        return false;
+    }
+    MINE::trace_block_header block;
+    while (fread(&block, sizeof(block), 1, in) == 1) {
+        if (block.type == MINE::TRACE_BLOCK_EVENTS) {
+            MINE::trace_record first;
+            event_block b = {ftello(in), block.thread, block.count};
+            if (block.count == 0) {
+                continue;
+            }
+            if (b.offset > st.st_size || block.count >
+                (uint64_t)(st.st_size - b.offset) / sizeof(first) ||
+                fread(&first, sizeof(first), 1, in) != 1 ||
+                fseeko(in, (off_t)(block.count - 1) * sizeof(first),
+                    SEEK_CUR) != 0) {
+                break;
+            }
+            index.blocks.push_back(b);
+            index.threads.insert(block.thread);
+            index.first = std::min(index.first, first.timestamp);
+            continue;
+        }
+        if (block.type < MINE::TRACE_BLOCK_TIMER_NAMES ||
+            block.type > MINE::TRACE_BLOCK_PHASE_NAMES) {
+            break;
+        }
+        std::vector<std::string>& names =
+            index.names[block.type - MINE::TRACE_BLOCK_TIMER_NAMES];
+        for (uint64_t i = 0 ; i < block.count ; i++) {
+            uint32_t id_length[2];
+            if (fread(id_length, sizeof(id_length), 1, in) != 1) {
+                return true;
+            }
+            std::string n(id_length[1], '\0');
+            if (id_length[1] > 0 &&
+                fread(&n[0], 1, id_length[1], in) != id_length[1]) {
+                return true;
+            }
+            if (id_length[0] >= names.size()) {
+                names.resize(id_length[0] + 1);
+            }
+            names[id_length[0]] = escape(n);
+        }
+    }
+    return true;
+}
+
+/* Each event follows the metadata events, after a comma */
+void write_event(FILE * out, trace_index& index, uint32_t thread,
+    const MINE::trace_record& r) {
+    double ts = (r.timestamp - index.first) * 1.0e-3;
+    switch (r.kind) {
+        case MINE::TRACE_TIMER_START:
+        case MINE::TRACE_TIMER_STOP:
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+                "\"pid\":0,\"tid\":%u}", name(index, 0, r.id).c_str(),
+                r.kind == MINE::TRACE_TIMER_START ? "B" : "E", ts, thread);
+            break;
+        case MINE::TRACE_COUNTER_SAMPLE:
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,"
+                "\"pid\":0,\"tid\":%u,\"args\":{\"value\":%.17g}}",
+                name(index, 1, r.id).c_str(), ts, thread, r.value);
+            break;
+        case MINE::TRACE_PHASE_START:
+        case MINE::TRACE_PHASE_STOP:
+            fprintf(out, ",\n{\"name\":\"%s %d\",\"cat\":\"phase\","
+                "\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%u,"
+                "\"args\":{\"iteration\":%d}}",
+                name(index, 2, r.id).c_str(), (int)r.value,
+                r.kind == MINE::TRACE_PHASE_START ? "B" : "E", ts, thread,
+                (int)r.value);
+            break;
+        default:
+            break;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <trace> [output]\n", argv[0]);
+        return 1;
+    }
+    FILE * in = fopen(argv[1], "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+    trace_index index;
+    if (!read_index(in, index)) {
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    FILE * out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (out == nullptr) {
+        fprintf(stderr, "Unable to open %s\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+        "\"args\":{\"name\":\"perfstubs\"}}");
+    for (uint32_t t : index.threads) {
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+            "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", t, t);
+    }
+    uint64_t events = 0;
+    std::vector<MINE::trace_record> records(4096);
+    for (const event_block& b : index.blocks) {
+        if (fseeko(in, b.offset, SEEK_SET) != 0) {
+            break;
+        }
+        for (uint64_t done = 0 ; done < b.count ; ) {
+            size_t n = (size_t)std::min<uint64_t>(records.size(),
+                b.count - done);
+            size_t got = fread(records.data(), sizeof(MINE::trace_record),
+                n, in);
+            for (size_t i = 0 ; i < got ; i++) {
+                write_event(out, index, b.thread, records[i]);
+            }
+            events += got;
+            if (got != n) {
+                break;
+            }
+            done += n;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+        printf("Converted %llu events on %zu threads to %s\n",
+            (unsigned long long)events, index.threads.size(), argv[2]);
+    }
+    return 0;
+}
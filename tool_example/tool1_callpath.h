@@ -0,0 +1,132 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/* Calling context trees for the reference tool (PS_TOOL_CALLPATH).
+ *
+ * Each thread builds its own tree: the node of a timer is a child of the
+ * node of the timer that was running when it started.  Nodes are never
+ * freed, and are allocated from a per-thread arena that hands out memory by
+ * bumping a pointer, so starting a timer only allocates when it is called
+ * from a new context, and then only a new arena block every few hundred
+ * nodes.
+ *
+ * The children of a node are kept in a small array inside the node, which
+ * overflows to a chain of arrays allocated from the same arena.  Only the
+ * owning thread adds children; a child is stored before the count that
+ * includes it is published, so other threads can walk the tree while it
+ * grows. */
+
+namespace external {
+    namespace ps_implementation {
+
+        struct cct_node;
+
+        struct cct_children {
+            static const uint32_t size = 6;
+            std::atomic<uint32_t> count;
+            std::atomic<cct_children*> next;
+            std::atomic<cct_node*> nodes[size];
+            cct_children() : count(0), next(nullptr) {
+                for (uint32_t i = 0 ; i < size ; i++) {
+                    nodes[i].store(nullptr, std::memory_order_relaxed);
+                }
+            }
+        };
+
+        /* The accumulators of a timer in one calling context, written by
+         * the owning thread as the flat timer_values are */
+        struct cct_node {
+            uint32_t timer;
+            /* calls are extrapolated from the sampled calls, as the times */
+            std::atomic<uint64_t> calls;
+            std::atomic<uint64_t> sampled;
+            std::atomic<uint64_t> inclusive;
+            std::atomic<uint64_t> exclusive;
+            cct_children children;
+            cct_node(uint32_t id) : timer(id), calls(0), sampled(0),
+                inclusive(0), exclusive(0) {}
+        };
+
+        class cct_arena {
+            public:
+                static const size_t block_size = 64 * 1024;
+                cct_arena() : _next(nullptr), _left(0) {}
+                template <typename T, typename... Args>
+                T* make(Args... args) {
+                    static_assert(sizeof(T) <= block_size,
+                        "objects must fit in an arena block");
+                    const size_t size = (sizeof(T) + alignof(T) - 1) &
+                        ~(alignof(T) - 1);
+                    size_t pad = (alignof(T) - (size_t)_next % alignof(T)) %
+                        alignof(T);
+                    if (_left < pad + size) {
+                        /* The previous block is left to the nodes in it */
+                        _next = (char *)malloc(block_size);
+                        if (_next == nullptr) {
+                            throw std::bad_alloc();
+                        }
+                        _left = block_size;
+                        pad = 0;
+                    }
+                    T* object = new (_next + pad) T(args...);
+                    _next += pad + size;
+                    _left -= pad + size;
+                    return object;
+                }
+            private:
+                char * _next;
+                size_t _left;
+        };
+
+        /* Find the child of a node for a timer, adding it if this is the
+         * first call from that context.  Only called by the owning
+         * thread. */
+        static inline cct_node * cct_child(cct_arena& arena,
+            cct_node * parent, uint32_t timer) {
+            cct_children * c = &parent->children;
+            for (;;) {
+                uint32_t n = c->count.load(std::memory_order_relaxed);
+                for (uint32_t i = 0 ; i < n ; i++) {
+                    cct_node * node = c->nodes[i].load(
+                        std::memory_order_relaxed);
+                    if (node->timer == timer) {
+                        return node;
+                    }
+                }
+                if (n < cct_children::size) {
+                    cct_node * node = arena.make<cct_node>(timer);
+                    c->nodes[n].store(node, std::memory_order_relaxed);
+                    c->count.store(n + 1, std::memory_order_release);
+                    return node;
+                }
+                cct_children * next = c->next.load(std::memory_order_relaxed);
+                if (next == nullptr) {
+                    next = arena.make<cct_children>();
+                    c->next.store(next, std::memory_order_release);
+                }
+                c = next;
+            }
+        }
+
+        /* Call f on each child of a node, from any thread */
+        template <typename F>
+        static inline void cct_for_each_child(const cct_node * parent, F f) {
+            for (const cct_children * c = &parent->children ; c != nullptr ;
+                c = c->next.load(std::memory_order_acquire)) {
+                uint32_t n = c->count.load(std::memory_order_acquire);
+                for (uint32_t i = 0 ; i < n ; i++) {
+                    f(c->nodes[i].load(std::memory_order_relaxed));
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,178 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#include "tool1_counters.h"
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace external {
+    namespace ps_implementation {
+        size_t num_hw_counters{0};
+
+        namespace {
+            std::vector<std::string> names;
+#ifdef __linux__
+            struct event {
+                const char * name;
+                uint32_t type;
+                uint64_t config;
+            };
+
+            const event events[] = {
+                {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {"instructions", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_INSTRUCTIONS},
+                {"ref_cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+                {"cache_references", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_CACHE_REFERENCES},
+                /* "usually" the last level cache, according to perf */
+                {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {"branches", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+                {"branch_misses", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_BRANCH_MISSES},
+                {"stalled_cycles_frontend", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+                {"stalled_cycles_backend", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+                /* Software events, counted by the kernel */
+                {"task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+                {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+                {"context_switches", PERF_TYPE_SOFTWARE,
+                    PERF_COUNT_SW_CONTEXT_SWITCHES},
+                {"cpu_migrations", PERF_TYPE_SOFTWARE,
+                    PERF_COUNT_SW_CPU_MIGRATIONS}
+            };
+
+            std::vector<perf_event_attr> attributes;
+
+            /* A known event name, or a raw event as "r<hex>", as in perf */
+            bool find_event(const std::string& name, perf_event_attr& attr) {
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                for (const auto& e : events) {
+                    if (name == e.name) {
+                        attr.type = e.type;
+                        attr.config = e.config;
+                        return true;
+                    }
+                }
+                if (name.size() > 1 && name[0] == 'r') {
+                    char * end = nullptr;
+                    attr.type = PERF_TYPE_RAW;
+                    attr.config = strtoull(name.c_str() + 1, &end, 16);
+                    return *end == '\0';
+                }
+                return false;
+            }
+
+            int open_event(perf_event_attr& attr) {
+                /* this thread, on any cpu */
+                return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            }
+#endif
+        }
+
+#ifdef __linux__
+        hw_counter_set::hw_counter_set() {
+            long page_size = sysconf(_SC_PAGESIZE);
+            for (size_t i = 0 ; i < max_hw_counters ; i++) {
+                _fds[i] = -1;
+                _pages[i] = nullptr;
+                if (i >= num_hw_counters) {
+                    continue;
+                }
+                _fds[i] = open_event(attributes[i]);
+                if (_fds[i] < 0) {
+                    continue;
+                }
+                void * page = mmap(nullptr, page_size, PROT_READ, MAP_SHARED,
+                    _fds[i], 0);
+                if (page != MAP_FAILED) {
+                    _pages[i] = (perf_event_mmap_page *)page;
+                }
+            }
+        }
+
+        hw_counter_set::~hw_counter_set() {
+            long page_size = sysconf(_SC_PAGESIZE);
+            for (size_t i = 0 ; i < max_hw_counters ; i++) {
+                if (_pages[i] != nullptr) {
+                    munmap(_pages[i], page_size);
+                }
+                if (_fds[i] >= 0) {
+                    close(_fds[i]);
+                }
+            }
+        }
+#else
+        hw_counter_set::hw_counter_set() {}
+        hw_counter_set::~hw_counter_set() {}
+#endif
+
+        void hw_counters_initialize(void) {
+            const char * list = getenv("PS_TOOL_HW_COUNTERS");
+            if (list == nullptr || *list == '\0') {
+                return;
+            }
+#ifdef __linux__
+            std::string all(list);
+            size_t begin = 0;
+            while (begin <= all.size()) {
+                size_t end = all.find(',', begin);
+                if (end == std::string::npos) {
+                    end = all.size();
+                }
+                std::string name = all.substr(begin, end - begin);
+                begin = end + 1;
+                if (name.empty()) {
+                    continue;
+                }
+                if (names.size() == max_hw_counters) {
+                    std::cerr << "Tool: at most " << max_hw_counters
+                              << " hardware counters, ignoring " << name
+                              << std::endl;
+                    continue;
+                }
+                perf_event_attr attr;
+                if (!find_event(name, attr)) {
+                    std::cerr << "Tool: unknown hardware counter " << name
+                              << std::endl;
+                    continue;
+                }
+                /* Check that this process is allowed to count the event */
+                int fd = open_event(attr);
+                if (fd < 0) {
+                    std::cerr << "Tool: unable to count " << name << ": "
+                              << strerror(errno) << std::endl;
+                    continue;
+                }
+                close(fd);
+                names.push_back(name);
+                attributes.push_back(attr);
+            }
+            num_hw_counters = names.size();
+#else
+            std::cerr << "Tool: hardware counters are only supported on Linux"
+                      << std::endl;
+#endif
+        }
+
+        hw_counter_set * hw_counters_register_thread(void) {
+            return new hw_counter_set();
+        }
+
+        const std::vector<std::string>& hw_counter_names(void) {
+            return names;
+        }
+    }
+}
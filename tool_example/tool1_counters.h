@@ -0,0 +1,104 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <unistd.h>
+#endif
+
+/* Hardware performance counters for the reference tool.
+ *
+ * The events named in PS_TOOL_HW_COUNTERS (a comma separated list, such as
+ * "cycles,instructions,llc_misses,branch_misses") are opened for each
+ * thread with perf_event_open(), counting user space only.  Where the
+ * kernel allows it, the counters are read with the rdpmc instruction from
+ * the event's mmapped page, otherwise with read().
+ *
+ * The events are opened separately rather than as a group, so if more
+ * events are requested than the processor has counters, the kernel
+ * multiplexes them and the counts only cover part of the time.
+ */
+
+namespace external {
+    namespace ps_implementation {
+
+        static const size_t max_hw_counters = 4;
+
+        /* The number of events being counted, 0 if disabled */
+        extern size_t num_hw_counters;
+
+        /* The events opened by one thread.  Only used by that thread. */
+        class hw_counter_set {
+            public:
+                hw_counter_set();
+                ~hw_counter_set();
+                /* Only called by the owning thread */
+                inline void read(uint64_t * values) {
+                    for (size_t i = 0 ; i < num_hw_counters ; i++) {
+                        values[i] = read_one(i);
+                    }
+                }
+            private:
+#ifdef __linux__
+                inline uint64_t read_one(size_t i) {
+#if defined(__x86_64__) || defined(__i386__)
+                    /* The seqlock protocol described in perf_event.h */
+                    volatile perf_event_mmap_page * page = _pages[i];
+                    if (page != nullptr) {
+                        uint32_t seq;
+                        uint64_t count;
+                        bool direct;
+                        do {
+                            seq = page->lock;
+                            __asm__ __volatile__("" ::: "memory");
+                            uint32_t index = page->index;
+                            direct = page->cap_user_rdpmc && index != 0;
+                            count = page->offset;
+                            if (direct) {
+                                uint32_t low, high;
+                                __asm__ __volatile__("rdpmc" : "=a"(low),
+                                    "=d"(high) : "c"(index - 1));
+                                uint32_t shift = 64 - page->pmc_width;
+                                int64_t pmc = (int64_t)(((uint64_t)high << 32) |
+                                    low);
+                                count += (uint64_t)((pmc << shift) >> shift);
+                            }
+                            __asm__ __volatile__("" ::: "memory");
+                        } while (page->lock != seq);
+                        if (direct) {
+                            return count;
+                        }
+                    }
+#endif
+                    uint64_t count = 0;
+                    if (_fds[i] >= 0 &&
+                        ::read(_fds[i], &count, sizeof(count)) !=
+                        sizeof(count)) {
+                        count = 0;
+                    }
+                    return count;
+                }
+                int _fds[max_hw_counters];
+                perf_event_mmap_page * _pages[max_hw_counters];
+#else
+                inline uint64_t read_one(size_t i) {
+                    (void)(i);
+                    return 0;
+                }
+#endif
+        };
+
+        /* Read PS_TOOL_HW_COUNTERS, and keep the events that can be opened */
+        void hw_counters_initialize(void);
+        /* Open the events for the calling thread */
+        hw_counter_set * hw_counters_register_thread(void);
+        const std::vector<std::string>& hw_counter_names(void);
+    }
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+/* Log-linear histograms for the reference tool, in the style of
+ * HdrHistogram.
+ *
+ * Each power of two from 2^min_exponent to 2^max_exponent is split into
+ * 2^sub_bits buckets of equal width, so a bucket is at most 1/8 of its
+ * lower bound wide.  The bucket of a value is its exponent and the top
+ * mantissa bits of its IEEE double representation, found with one shift.
+ * Values below 2^min_exponent (including zero and negative values) are
+ * counted in the first bucket, and values above the range in the last. */
+
+namespace external {
+    namespace ps_implementation {
+
+        class histogram {
+            public:
+                static const int sub_bits = 3;
+                static const int min_exponent = -8;
+                static const int max_exponent = 48;
+                static const uint32_t num_buckets =
+                    ((max_exponent - min_exponent) << sub_bits) + 1;
+
+                static inline uint32_t index(double value) {
+                    /* also false for NaN */
+                    if (!(value >= min_value())) {
+                        return 0;
+                    }
+                    uint64_t bits;
+                    memcpy(&bits, &value, sizeof(bits));
+                    uint64_t key = bits >> (52 - sub_bits);
+                    uint64_t first = (uint64_t)(1023 + min_exponent) << sub_bits;
+                    uint64_t b = key - first + 1;
+                    return b < num_buckets ? (uint32_t)b : num_buckets - 1;
+                }
+
+                static double min_value(void) {
+                    return std::ldexp(1.0, min_exponent);
+                }
+
+                static double lower(uint32_t b) {
+                    if (b == 0) {
+                        return -std::numeric_limits<double>::infinity();
+                    }
+                    uint32_t octave = (b - 1) >> sub_bits;
+                    uint32_t sub = (b - 1) & ((1 << sub_bits) - 1);
+                    return std::ldexp(1.0 + (double)sub / (1 << sub_bits),
+                        min_exponent + (int)octave);
+                }
+
+                static double upper(uint32_t b) {
+                    if (b + 1 == num_buckets) {
+                        return std::numeric_limits<double>::infinity();
+                    }
+                    return lower(b + 1);
+                }
+
+                /* Estimate the q quantile of the counts, interpolating
+                 * linearly in the bucket it falls in */
+                static double quantile(const uint64_t * counts, double q) {
+                    uint64_t total = 0;
+                    for (uint32_t b = 0 ; b < num_buckets ; b++) {
+                        total += counts[b];
+                    }
+                    if (total == 0) {
+                        return 0.0;
+                    }
+                    double rank = q * (double)total;
+                    uint64_t below = 0;
+                    for (uint32_t b = 0 ; b < num_buckets ; b++) {
+                        if (counts[b] > 0 && (double)(below + counts[b]) >= rank) {
+                            double low = lower(b);
+                            double high = upper(b);
+                            if (std::isinf(low)) {
+                                return high;
+                            }
+                            if (std::isinf(high)) {
+                                return low;
+                            }
+                            return low + (high - low) *
+                                ((rank - (double)below) / (double)counts[b]);
+                        }
+                        below += counts[b];
+                    }
+                    return lower(num_buckets - 1);
+                }
+
+                /* Only called by the owning thread */
+                inline void add(double value, uint64_t weight) {
+                    std::atomic<uint64_t>& c = _counts[index(value)];
+                    c.store(c.load(std::memory_order_relaxed) + weight,
+                        std::memory_order_relaxed);
+                }
+
+                uint64_t count(uint32_t b) const {
+                    return _counts[b].load(std::memory_order_relaxed);
+                }
+
+            private:
+                std::atomic<uint64_t> _counts[num_buckets];
+        };
+
+        /* The histogram of one timer or counter on one thread, allocated
+         * when the thread first records a value */
+        typedef std::atomic<histogram*> histogram_slot;
+    }
+}
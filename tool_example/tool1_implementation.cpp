@@ -3,45 +3,500 @@
 // (See accompanying file LICENSE.txt)
 
 #include "perfstubs_api/tool.h"
+#include "tool1_trace.h"
+#include "tool1_counters.h"
+#include "tool1_histogram.h"
+#include "tool1_shm.h"
+#include "tool1_profile.h"
+#include "tool1_callpath.h"
+#include "tool1_phase.h"
 #include <iostream>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <pthread.h>
+#include <unistd.h>
 
 using namespace std;
 
 namespace external {
     namespace ps_implementation {
+        /* The registry mutex is only taken when timers, counters or
+         * threads are created, and when the data is queried.  It is never
+         * taken on the start/stop/sample path. */
         std::mutex my_mutex;
         bool enabled{true};
+        /* The sampling period of new timers, from PS_TOOL_SAMPLING_PERIOD */
+        uint32_t default_period{1};
+        /* Timers called more than throttle_calls times on a thread, for
+         * less than throttle_ns per call, are throttled (PS_TOOL_THROTTLE) */
+        bool throttling{false};
+        uint64_t throttle_calls{100000};
+        uint64_t throttle_ns{10000};
+        /* Keep histograms of the timer durations and counter values
+         * (PS_TOOL_HISTOGRAMS) */
+        bool histograms{false};
+        /* Build a calling context tree per thread (PS_TOOL_CALLPATH) */
+        bool callpath{false};
+        /* Dump the profile to a binary file rather than as text
+         * (PS_TOOL_PROFILE=binary, PS_TOOL_PROFILE_FILE) */
+        bool binary_profile{false};
+        std::string profile_filename;
+        /* The iterations kept per dynamic phase, the older ones being
+         * summed (PS_TOOL_PHASE_ITERATIONS) */
+        uint32_t phase_iterations{65536};
 
+        /* Timers and counters are identified by a dense index, assigned
+         * once when they are created.  That index is used to find the
+         * calling thread's accumulators. */
         class profiler {
             public:
-                profiler(const std::string& name) : _name(name), _calls(0) {}
-                void start() { _calls++; }
-                void stop() { _calls++; }
+                profiler(const std::string& name, uint32_t id) :
+                    _throttled(false), _name(name), _file(nullptr),
+                    _func(nullptr), _line(0), _id(id),
+                    _period(default_period) {}
+                profiler(const char * file, const char * func, int line,
+                    uint32_t id) :
+                    _throttled(false), _file(file), _func(func),
+                    _line(line), _id(id), _period(default_period) {}
+                /* The name of a timer created from its location is only
+                 * formatted when it is first needed, with the registry
+                 * mutex held. */
+                const std::string& name(void) {
+                    if (_name.empty() && _func != nullptr) {
+                        _name = std::string(_func) + " [{" + _file + "} {" +
+                            std::to_string(_line) + ",0}]";
+                    }
+                    return _name;
+                }
+                /* Once set, starting and stopping the timer does nothing.
+                 * The flag is here rather than in timer.c, which only sees
+                 * opaque handles (see the README). */
+                std::atomic<bool> _throttled;
                 std::string _name;
-                int _calls;
+                const char * _file;
+                const char * _func;
+                int _line;
+                uint32_t _id;
+                /* Only 1 out of every _period start/stop pairs is timed */
+                std::atomic<uint32_t> _period;
         };
 
         class counter {
             public:
-                counter(const std::string& name) : _name(name) {}
+                counter(const std::string& name, uint32_t id) :
+                    _name(name), _id(id) {}
                 std::string _name;
+                uint32_t _id;
+        };
+
+        /* Accumulators for one timer on one thread.  Only the owning
+         * thread writes them, so updates are plain (relaxed) loads and
+         * stores; the atomics only make the concurrent reads in
+         * ps_tool_get_timer_data well defined. */
+        struct timer_values {
+            std::atomic<uint64_t> calls;
+            std::atomic<uint64_t> inclusive;
+            std::atomic<uint64_t> exclusive;
+            /* number of calls that were timed, when sampling */
+            std::atomic<uint64_t> sampled;
+            /* number of active instances on this thread's stack, so
+             * that recursive calls don't count their inclusive time twice */
+            uint32_t depth;
+            /* calls left to skip before the next sample */
+            uint32_t countdown;
+            /* number of active instances that weren't sampled */
+            uint32_t skipped;
+        };
+
+        /* Hardware counter accumulators for one timer on one thread, only
+         * allocated if counters are enabled (PS_TOOL_HW_COUNTERS) */
+        struct hw_values {
+            std::atomic<uint64_t> inclusive[max_hw_counters];
+            std::atomic<uint64_t> exclusive[max_hw_counters];
+        };
+
+        /* Samples of one counter on one thread, kept with Welford's
+         * algorithm.  As for the timers, only the owning thread writes
+         * them, so sampling needs no atomic read-modify-write.  A
+         * concurrent reader may see a partially applied sample. */
+        struct alignas(64) counter_values {
+            std::atomic<uint64_t> count;
+            std::atomic<double> mean;
+            /* the sum of the squared differences from the mean */
+            std::atomic<double> m2;
+            std::atomic<double> min;
+            std::atomic<double> max;
+        };
+
+        /* A snapshot of counter_values, which can be combined with
+         * another one (Chan et al.'s parallel variance) */
+        struct counter_summary {
+            uint64_t count;
+            double mean;
+            double m2;
+            double min;
+            double max;
+            counter_summary() : count(0), mean(0.0), m2(0.0), min(0.0),
+                max(0.0) {}
+            counter_summary(const counter_values& v) :
+                count(v.count.load(std::memory_order_relaxed)),
+                mean(v.mean.load(std::memory_order_relaxed)),
+                m2(v.m2.load(std::memory_order_relaxed)),
+                min(v.min.load(std::memory_order_relaxed)),
+                max(v.max.load(std::memory_order_relaxed)) {}
+            void merge(const counter_summary& other) {
+                if (other.count == 0) {
+                    return;
+                }
+                if (count == 0) {
+                    *this = other;
+                    return;
+                }
+                double n = (double)(count + other.count);
+                double delta = other.mean - mean;
+                mean += delta * ((double)other.count / n);
+                m2 += other.m2 + delta * delta *
+                    ((double)count * (double)other.count / n);
+                count += other.count;
+                min = std::min(min, other.min);
+                max = std::max(max, other.max);
+            }
+            double variance(void) const {
+                return count > 0 ? m2 / (double)count : 0.0;
+            }
+        };
+
+        /* The monotonic clock, in nanoseconds */
+        static inline uint64_t now(void) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        static inline void increment(std::atomic<uint64_t>& value,
+            uint64_t delta) {
+            value.store(value.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+        }
+
+        /* A dense, per-thread table indexed by timer (or counter) id.
+         * Storage is allocated in fixed size chunks that never move, so
+         * other threads can read it while the owner grows it.  Chunks are
+         * aligned to a cache line, so threads never share one. */
+        template <typename T>
+        class thread_table {
+                static_assert(std::is_trivially_destructible<T>::value,
+                    "thread_table entries are freed without destruction");
+            public:
+                static const size_t chunk_size = 256;
+                static const size_t max_chunks = 1024;
+                thread_table() {
+                    for (size_t i = 0 ; i < max_chunks ; i++) {
+                        _chunks[i].store(nullptr, std::memory_order_relaxed);
+                    }
+                }
+                ~thread_table() {
+                    for (size_t i = 0 ; i < max_chunks ; i++) {
+                        free(_chunks[i].load(std::memory_order_relaxed));
+                    }
+                }
+                /* Only called by the owning thread */
+                T& operator[](uint32_t id) {
+                    T* chunk = _chunks[id / chunk_size].load(
+                        std::memory_order_relaxed);
+                    if (chunk == nullptr) {
+                        chunk = allocate(id / chunk_size);
+                    }
+                    return chunk[id % chunk_size];
+                }
+                /* Called by any thread, returns nullptr if the owner has
+                 * never touched this id */
+                const T* find(uint32_t id) const {
+                    if (id / chunk_size >= max_chunks) {
+                        return nullptr;
+                    }
+                    const T* chunk = _chunks[id / chunk_size].load(
+                        std::memory_order_acquire);
+                    return chunk == nullptr ? nullptr : &chunk[id % chunk_size];
+                }
+                T* find(uint32_t id) {
+                    return const_cast<T*>(
+                        static_cast<const thread_table*>(this)->find(id));
+                }
+            private:
+                T* allocate(size_t index) {
+                    void * memory = nullptr;
+                    if (posix_memalign(&memory, 64, sizeof(T) * chunk_size)
+                        != 0) {
+                        throw std::bad_alloc();
+                    }
+                    T* chunk = (T*)memory;
+                    for (size_t i = 0 ; i < chunk_size ; i++) {
+                        new (&chunk[i]) T();
+                    }
+                    _chunks[index].store(chunk, std::memory_order_release);
+                    return chunk;
+                }
+                std::atomic<T*> _chunks[max_chunks];
+        };
+
+        /* One entry on a thread's timer stack.  The times of a sampled
+         * timer are scaled by its sampling period when the frame is
+         * popped, so the accumulators hold extrapolated values.  A call
+         * that wasn't sampled has a frame with a period of 0, which is
+         * popped without being timed. */
+        struct frame {
+            uint32_t id;
+            uint32_t period;
+            uint64_t start;
+            uint64_t children;
+            uint64_t hw_start[max_hw_counters];
+            uint64_t hw_children[max_hw_counters];
+            /* The calling context, if callpath is set */
+            cct_node * node;
+        };
+
+        /* A dynamic phase iteration started by the thread */
+        struct phase_frame {
+            phase * p;
+            int iteration;
+            uint64_t start;
+        };
+        static const size_t max_phase_depth = 16;
+
+        /* The phases a thread last used, by the address of their prefix */
+        struct phase_cache_entry {
+            const char * prefix;
+            phase * p;
+        };
+        static const size_t phase_cache_size = 8;
+
+        /* An interval of a timer (ps_tool_interval_begin), opened by the
+         * thread that owns the slot and closed by any thread.  The state
+         * is odd while the interval is open.  It is incremented when the
+         * interval is opened, and when it is closed with a compare and
+         * swap, so that a token can only close the interval it was
+         * issued for.  A closed slot is pushed on the closed list of its
+         * owner, linked by next (an index + 1, 0 ending the list). */
+        struct interval_slot {
+            std::atomic<uint32_t> state;
+            std::atomic<uint32_t> timer;
+            std::atomic<uint64_t> start;
+            std::atomic<uint32_t> next;
+        };
+
+        class thread_data {
+            public:
+                static const size_t max_depth = 256;
+                thread_data(uint32_t id) : _id(id), _seq(0), _depth(0),
+                    _num_intervals(0), _free_intervals(0),
+                    _closed_intervals(0),
+                    _phase_depth(0), _phase_cache(), _next_phase_cache(0),
+                    _trace(nullptr), _counters(nullptr),
+                    _cct(callpath ? _arena.make<cct_node>(UINT32_MAX) :
+                    nullptr) {}
+                uint32_t _id;
+                /* A sequence lock around the updates of the timer and
+                 * counter accumulators, odd while the owning thread is
+                 * updating them, so that they can be read consistently
+                 * without blocking the owner */
+                std::atomic<uint32_t> _seq;
+                thread_table<timer_values> _timers;
+                thread_table<hw_values> _hw;
+                thread_table<counter_values> _samples;
+                thread_table<histogram_slot> _timer_histograms;
+                thread_table<histogram_slot> _counter_histograms;
+                /* Frames deeper than max_depth are counted, but not timed */
+                size_t _depth;
+                frame _stack[max_depth];
+                /* Interval slots.  The free ones are reused oldest first,
+                 * from a list only the owner uses, refilled from the slots
+                 * that any thread closed (both lists hold an index + 1). */
+                thread_table<interval_slot> _intervals;
+                uint32_t _num_intervals;
+                uint32_t _free_intervals;
+                std::atomic<uint32_t> _closed_intervals;
+                /* Phases deeper than max_phase_depth are not timed */
+                size_t _phase_depth;
+                phase_frame _phases[max_phase_depth];
+                phase_cache_entry _phase_cache[phase_cache_size];
+                size_t _next_phase_cache;
+                /* Allocated on first use, if tracing */
+                trace_buffer * _trace;
+                /* Opened on first use by the thread, closed when it exits */
+                hw_counter_set * _counters;
+                /* The root of the calling context tree, if callpath is set.
+                 * Its children are the timers started with an empty
+                 * stack. */
+                cct_arena _arena;
+                cct_node * _cct;
+        };
+
+        /* Update the accumulators of the calling thread between
+         * begin_update() and end_update() */
+        static inline void begin_update(thread_data * td) {
+            td->_seq.store(td->_seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        static inline void end_update(thread_data * td) {
+            td->_seq.store(td->_seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+        }
+
+        /* Call read() until it runs without the owner updating the
+         * accumulators.  After a number of attempts, the values are
+         * returned anyway, so a busy thread can't stall the reader. */
+        template <typename F>
+        static inline void read_consistent(const thread_data * td, F read) {
+            for (int attempt = 0 ; attempt < 100 ; attempt++) {
+                uint32_t before = td->_seq.load(std::memory_order_acquire);
+                if ((before & 1) == 0) {
+                    read();
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (td->_seq.load(std::memory_order_relaxed) == before) {
+                        return;
+                    }
+                }
+            }
+            read();
+        }
+
+        /* Timers created from a source location are found by the
+         * contents of the location strings, without building the name */
+        struct location {
+            const char * file;
+            const char * func;
+            int line;
+        };
+
+        struct location_hash {
+            size_t operator()(const location& l) const {
+                size_t hash = 14695981039346656037ULL;
+                for (const char * c = l.file ; *c != '\0' ; c++) {
+                    hash = (hash ^ (unsigned char)(*c)) * 1099511628211ULL;
+                }
+                for (const char * c = l.func ; *c != '\0' ; c++) {
+                    hash = (hash ^ (unsigned char)(*c)) * 1099511628211ULL;
+                }
+                return (hash ^ (size_t)l.line) * 1099511628211ULL;
+            }
+        };
+
+        struct location_equal {
+            bool operator()(const location& a, const location& b) const {
+                return a.line == b.line && strcmp(a.func, b.func) == 0 &&
+                    strcmp(a.file, b.file) == 0;
+            }
         };
 
         std::unordered_map<std::string, profiler*> profilers;
+        std::unordered_map<location, profiler*, location_hash,
+            location_equal> locations;
         std::unordered_map<std::string, counter*> counters;
+        std::vector<profiler*> profiler_list;
+        std::vector<counter*> counter_list;
+        /* One descriptor per dynamic phase prefix, never freed */
+        std::unordered_map<std::string, phase*> phases;
+        std::vector<phase*> phase_list;
+        /* Thread data is never freed, so that the measurements of
+         * threads that have exited can still be reported.  When a thread
+         * exits, its data is reused by the next new thread, so that
+         * short-lived threads don't grow the tables without bound. */
+        std::vector<thread_data*> threads;
+        std::vector<thread_data*> free_threads;
+        /* The threads by id, for the threads closing intervals, which
+         * can't take the registry mutex */
+        thread_table<std::atomic<thread_data*> > thread_index;
+
+        thread_local thread_data * my_thread{nullptr};
+
+        void deregister_thread(void);
+
+        /* Threads are registered on first use, which may be a start of a
+         * timer created by another thread, without PerfStubs seeing the
+         * thread.  The tool's own key makes sure their data is recycled
+         * when they exit; if PerfStubs deregisters the thread first, the
+         * second call does nothing. */
+        pthread_key_t exit_key;
+        std::once_flag exit_key_once;
+
+        static void thread_exit(void * value) {
+            (void)(value);
+            deregister_thread();
+        }
+
+        thread_data * register_thread(void) {
+            std::call_once(exit_key_once, [] {
+                (void) pthread_key_create(&exit_key, thread_exit);
+            });
+            pthread_setspecific(exit_key, (void*)1UL);
+            std::lock_guard<std::mutex> guard(my_mutex);
+            if (!free_threads.empty()) {
+                my_thread = free_threads.back();
+                free_threads.pop_back();
+                return my_thread;
+            }
+            my_thread = new thread_data(threads.size());
+            threads.push_back(my_thread);
+            thread_index[my_thread->_id].store(my_thread,
+                std::memory_order_release);
+            return my_thread;
+        }
+
+        static inline thread_data * this_thread(void) {
+            thread_data * td = my_thread;
+            if (td == nullptr) {
+                td = register_thread();
+            }
+            return td;
+        }
 
         void * find_timer(const char * timer_name) {
             std::string name(timer_name);
             std::lock_guard<std::mutex> guard(my_mutex);
             auto iter = profilers.find(name);
             if (iter == profilers.end()) {
-                profiler * p = new profiler(name);
+                if (profiler_list.size() >= thread_table<timer_values>::chunk_size *
+                    thread_table<timer_values>::max_chunks) {
+                    return nullptr;
+                }
+                profiler * p = new profiler(name, profiler_list.size());
                 profilers.insert(std::pair<std::string,profiler*>(name,p));
+                profiler_list.push_back(p);
+                return (void*)p;
+            }
+            return (void*)iter->second;
+        }
+
+        void * find_timer(const char * file, const char * func, int line) {
+            location l = {file, func, line};
+            std::lock_guard<std::mutex> guard(my_mutex);
+            auto iter = locations.find(l);
+            if (iter == locations.end()) {
+                if (profiler_list.size() >= thread_table<timer_values>::chunk_size *
+                    thread_table<timer_values>::max_chunks) {
+                    return nullptr;
+                }
+                profiler * p = new profiler(file, func, line,
+                    profiler_list.size());
+                locations.insert(std::pair<location,profiler*>(l,p));
+                profiler_list.push_back(p);
                 return (void*)p;
             }
             return (void*)iter->second;
@@ -52,13 +507,1322 @@ namespace external {
             std::lock_guard<std::mutex> guard(my_mutex);
             auto iter = counters.find(name);
             if (iter == counters.end()) {
-                counter * c = new counter(name);
+                if (counter_list.size() >= thread_table<counter_values>::chunk_size *
+                    thread_table<counter_values>::max_chunks) {
+                    return nullptr;
+                }
+                counter * c = new counter(name, counter_list.size());
                 counters.insert(std::pair<std::string,counter*>(name,c));
+                counter_list.push_back(c);
                 return (void*)c;
             }
             return (void*)iter->second;
         }
 
+        static inline trace_buffer * trace(thread_data * td) {
+            if (td->_trace == nullptr) {
+                td->_trace = trace_register_thread(td->_id);
+            }
+            return td->_trace;
+        }
+
+        phase * find_phase(const char * prefix) {
+            std::string name(prefix);
+            std::lock_guard<std::mutex> guard(my_mutex);
+            auto iter = phases.find(name);
+            if (iter == phases.end()) {
+                phase * p = new phase(name, phase_list.size(),
+                    phase_iterations);
+                phases.insert(std::pair<std::string,phase*>(name,p));
+                phase_list.push_back(p);
+                return p;
+            }
+            return iter->second;
+        }
+
+        /* Prefixes are usually string literals, so the thread's recent
+         * phases are looked up by address first, checking the contents in
+         * case the buffer was reused */
+        static inline phase * find_phase(thread_data * td,
+            const char * prefix) {
+            for (const auto& e : td->_phase_cache) {
+                if (e.prefix == prefix && strcmp(e.p->_name.c_str(),
+                    prefix) == 0) {
+                    return e.p;
+                }
+            }
+            phase * p = find_phase(prefix);
+            td->_phase_cache[td->_next_phase_cache++ % phase_cache_size] =
+                {prefix, p};
+            return p;
+        }
+
+        void phase_start(const char * prefix, int iteration) {
+            if (!enabled) {
+                return;
+            }
+            thread_data * td = this_thread();
+            phase * p = find_phase(td, prefix);
+            uint64_t start = now();
+            if (td->_phase_depth < max_phase_depth) {
+                td->_phases[td->_phase_depth++] = {p, iteration, start};
+            }
+            /* a slice around the timers of the iteration in the trace */
+            if (tracing.load(std::memory_order_relaxed)) {
+                trace(td)->push(TRACE_PHASE_START, p->_id, start,
+                    (double)iteration);
+            }
+        }
+
+        /* Phases are expected to nest, but the iteration is found even if
+         * they don't */
+        void phase_stop(const char * prefix, int iteration) {
+            if (!enabled) {
+                return;
+            }
+            uint64_t end = now();
+            thread_data * td = this_thread();
+            phase * p = find_phase(td, prefix);
+            for (size_t i = td->_phase_depth ; i > 0 ; i--) {
+                phase_frame& f = td->_phases[i - 1];
+                if (f.p == p && f.iteration == iteration) {
+                    p->record(iteration, end - f.start);
+                    std::copy(td->_phases + i, td->_phases + td->_phase_depth,
+                        td->_phases + i - 1);
+                    td->_phase_depth--;
+                    break;
+                }
+            }
+            if (tracing.load(std::memory_order_relaxed)) {
+                trace(td)->push(TRACE_PHASE_STOP, p->_id, end,
+                    (double)iteration);
+            }
+        }
+
+        /* Only called by the owning thread */
+        static inline void record(thread_table<histogram_slot>& table,
+            uint32_t id, double value, uint64_t weight) {
+            histogram_slot& slot = table[id];
+            histogram * h = slot.load(std::memory_order_relaxed);
+            if (h == nullptr) {
+                h = new histogram();
+                slot.store(h, std::memory_order_release);
+            }
+            h->add(value, weight);
+        }
+
+        /* Sum the histograms of all threads.  Called with the registry
+         * mutex held. */
+        void merge_histograms(thread_table<histogram_slot> thread_data::*table,
+            uint32_t id, uint64_t * counts) {
+            memset(counts, 0, histogram::num_buckets * sizeof(uint64_t));
+            for (auto td : threads) {
+                const histogram_slot * slot = (td->*table).find(id);
+                const histogram * h = slot == nullptr ? nullptr :
+                    slot->load(std::memory_order_acquire);
+                for (uint32_t b = 0 ; h != nullptr &&
+                    b < histogram::num_buckets ; b++) {
+                    counts[b] += h->count(b);
+                }
+            }
+        }
+
+        static inline void read_counters(thread_data * td, uint64_t * values) {
+            if (num_hw_counters == 0) {
+                return;
+            }
+            if (td->_counters == nullptr) {
+                td->_counters = hw_counters_register_thread();
+            }
+            td->_counters->read(values);
+        }
+
+        void start(profiler * p) {
+            if (p->_throttled.load(std::memory_order_relaxed) || !enabled) {
+                return;
+            }
+            thread_data * td = this_thread();
+            timer_values& v = td->_timers[p->_id];
+            /* Only the outermost instance of a recursive timer decides
+             * whether to sample, the nested instances follow it */
+            uint32_t period = p->_period.load(std::memory_order_relaxed);
+            bool skip = v.skipped > 0;
+            if (!skip && period > 1 && v.depth == 0) {
+                if (v.countdown > 0) {
+                    v.countdown--;
+                    skip = true;
+                } else {
+                    v.countdown = period - 1;
+                }
+            }
+            /* A skipped call keeps its place on the stack, so that the
+             * timers it calls have the right parent, but doesn't read the
+             * clock, and the times of its children are dropped: the
+             * sampled calls stand for them. */
+            frame * f = nullptr;
+            if (td->_depth < thread_data::max_depth) {
+                f = &td->_stack[td->_depth];
+                f->id = p->_id;
+                f->period = skip ? 0 : (period > 1 ? period : 1);
+                f->children = 0;
+                f->node = nullptr;
+                if (callpath) {
+                    f->node = cct_child(td->_arena, td->_depth > 0 ?
+                        td->_stack[td->_depth - 1].node : td->_cct, p->_id);
+                }
+            }
+            /* The calls are counted in an update, so that a reader sees
+             * them in step with the times */
+            begin_update(td);
+            increment(v.calls, 1);
+            if (!skip) {
+                increment(v.sampled, 1);
+                if (f != nullptr && f->node != nullptr) {
+                    increment(f->node->calls, f->period);
+                    increment(f->node->sampled, 1);
+                }
+            }
+            end_update(td);
+            td->_depth++;
+            if (skip) {
+                v.skipped++;
+                return;
+            }
+            if (f != nullptr) {
+                v.depth++;
+                f->start = now();
+                if (tracing.load(std::memory_order_relaxed)) {
+                    trace(td)->push(TRACE_TIMER_START, p->_id, f->start);
+                }
+                if (num_hw_counters > 0) {
+                    memset(f->hw_children, 0, sizeof(f->hw_children));
+                    read_counters(td, f->hw_start);
+                }
+            }
+        }
+
+        /* Attribute the counts of a popped frame, as for the times */
+        static inline void pop_counters(thread_data * td, const frame& f,
+            const uint64_t * hw_end, bool outermost) {
+            hw_values& h = td->_hw[f.id];
+            frame * parent = nullptr;
+            if (td->_depth > 0 && td->_depth <= thread_data::max_depth) {
+                parent = &td->_stack[td->_depth - 1];
+            }
+            for (size_t i = 0 ; i < num_hw_counters ; i++) {
+                uint64_t inclusive = (hw_end[i] - f.hw_start[i]) * f.period;
+                uint64_t children = f.hw_children[i] * f.period;
+                if (children < inclusive) {
+                    increment(h.exclusive[i], inclusive - children);
+                }
+                if (outermost) {
+                    increment(h.inclusive[i], inclusive);
+                }
+                if (parent != nullptr) {
+                    parent->hw_children[i] += inclusive;
+                }
+            }
+        }
+
+        /* Pop the top frame of the thread's stack at time "end", with the
+         * hardware counts "hw_end" */
+        static inline void pop(thread_data * td, uint64_t end,
+            const uint64_t * hw_end) {
+            td->_depth--;
+            if (td->_depth >= thread_data::max_depth) {
+                return;
+            }
+            frame& f = td->_stack[td->_depth];
+            /* a skipped call */
+            if (f.period == 0) {
+                return;
+            }
+            if (tracing.load(std::memory_order_relaxed)) {
+                trace(td)->push(TRACE_TIMER_STOP, f.id, end);
+            }
+            timer_values& v = td->_timers[f.id];
+            uint64_t inclusive = (end - f.start) * f.period;
+            /* The children's times are extrapolated with the period of
+             * this frame too, and with their own if they are sampled, so
+             * they can exceed the parent's */
+            uint64_t children = f.children * f.period;
+            begin_update(td);
+            if (children < inclusive) {
+                increment(v.exclusive, inclusive - children);
+            }
+            bool outermost = --v.depth == 0;
+            if (outermost) {
+                increment(v.inclusive, inclusive);
+            }
+            /* A recursive call has its own context, so its inclusive time
+             * is always counted */
+            if (f.node != nullptr) {
+                increment(f.node->inclusive, inclusive);
+                if (children < inclusive) {
+                    increment(f.node->exclusive, inclusive - children);
+                }
+            }
+            end_update(td);
+            if (td->_depth > 0 && td->_depth <= thread_data::max_depth) {
+                td->_stack[td->_depth - 1].children += inclusive;
+            }
+            if (num_hw_counters > 0) {
+                pop_counters(td, f, hw_end, outermost);
+            }
+            /* A sampled call stands for period calls */
+            if (histograms) {
+                record(td->_timer_histograms, f.id, (double)(end - f.start),
+                    f.period);
+            }
+        }
+
+        /* Throttle the timer if its mean time per call on this thread is
+         * below the threshold.  Only checked when the outermost instance
+         * stops, so this thread has no frames of it left open. */
+        static inline void throttle(profiler * p, const timer_values& v) {
+            uint64_t calls = v.calls.load(std::memory_order_relaxed);
+            if (calls > throttle_calls && v.inclusive.load(
+                std::memory_order_relaxed) < calls * throttle_ns) {
+                p->_throttled.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        void stop(profiler * p) {
+            /* If another thread throttled the timer while this thread had
+             * it open, the open frame is popped when its caller stops. */
+            if (p->_throttled.load(std::memory_order_relaxed)) {
+                return;
+            }
+            thread_data * td = this_thread();
+            timer_values& v = td->_timers[p->_id];
+            /* Frames beyond the maximum depth aren't timed, just pop */
+            if (td->_depth > thread_data::max_depth) {
+                v.skipped -= v.skipped > 0 ? 1 : 0;
+                td->_depth--;
+                return;
+            }
+            /* A skipped call on top of the stack is popped without reading
+             * the clock */
+            if (v.skipped > 0) {
+                v.skipped--;
+                if (td->_depth > 0 && td->_stack[td->_depth - 1].id == p->_id &&
+                    td->_stack[td->_depth - 1].period == 0) {
+                    td->_depth--;
+                    return;
+                }
+            }
+            /* Only the calls that are timed read the clock */
+            uint64_t end = now();
+            /* Find the timer on the stack.  Usually it is on top, but if
+             * timers overlap, stop the ones that were started after it. */
+            size_t i = td->_depth;
+            while (i > 0 && td->_stack[i - 1].id != p->_id) {
+                i--;
+            }
+            if (i == 0) {
+                return;
+            }
+            uint64_t hw_end[max_hw_counters];
+            read_counters(td, hw_end);
+            while (td->_depth >= i) {
+                pop(td, end, hw_end);
+            }
+            if (throttling && v.depth == 0) {
+                throttle(p, v);
+            }
+        }
+
+        void stop_current(void) {
+            thread_data * td = this_thread();
+            if (td->_depth > 0) {
+                uint64_t end = now();
+                uint64_t hw_end[max_hw_counters];
+                read_counters(td, hw_end);
+                pop(td, end, hw_end);
+            }
+        }
+
+        /* A token is the id of the thread that owns the slot (16 bits),
+         * the low 30 bits of the slot's state and the slot's index (18
+         * bits).  An old token can only close a new interval in its slot if
+         * the slot was reused 2^29 times since, and a thread goes through
+         * its free slots in turn, at least a chunk of them, before it
+         * reuses one. */
+        static const uint32_t max_interval_threads = 1 << 16;
+        static const uint32_t interval_slot_bits = 18;
+        static const uint32_t max_interval_slots = 1 << interval_slot_bits;
+        static const uint32_t interval_state_mask = (1u << 30) - 1;
+        static_assert(thread_table<interval_slot>::chunk_size *
+            thread_table<interval_slot>::max_chunks == max_interval_slots,
+            "a token holds the index of any interval slot");
+
+        /* Take the slots closed since the last call, as the free list of
+         * the owner, oldest first */
+        static void collect_intervals(thread_data * td) {
+            uint32_t closed = td->_closed_intervals.exchange(0,
+                std::memory_order_acquire);
+            uint32_t reversed = 0;
+            while (closed != 0) {
+                interval_slot& slot = td->_intervals[closed - 1];
+                uint32_t next = slot.next.load(std::memory_order_relaxed);
+                slot.next.store(reversed, std::memory_order_relaxed);
+                reversed = closed;
+                closed = next;
+            }
+            td->_free_intervals = reversed;
+        }
+
+        uint64_t interval_begin(profiler * p) {
+            if (p->_throttled.load(std::memory_order_relaxed) || !enabled) {
+                return 0;
+            }
+            thread_data * td = this_thread();
+            if (td->_id >= max_interval_threads) {
+                return 0;
+            }
+            /* Use a new slot until there is a chunk of them, then the free
+             * slots, so that a slot isn't reused as soon as it is closed */
+            if (td->_free_intervals == 0 && td->_num_intervals >=
+                thread_table<interval_slot>::chunk_size) {
+                collect_intervals(td);
+            }
+            uint32_t index;
+            if (td->_free_intervals != 0) {
+                index = td->_free_intervals - 1;
+                td->_free_intervals = td->_intervals[index].next.load(
+                    std::memory_order_relaxed);
+            } else {
+                if (td->_num_intervals == max_interval_slots) {
+                    return 0;
+                }
+                index = td->_num_intervals++;
+            }
+            interval_slot& slot = td->_intervals[index];
+            uint32_t state = slot.state.load(std::memory_order_relaxed) + 1;
+            slot.timer.store(p->_id, std::memory_order_relaxed);
+            slot.start.store(now(), std::memory_order_relaxed);
+            slot.state.store(state, std::memory_order_release);
+            return ((uint64_t)td->_id << 48) |
+                ((uint64_t)(state & interval_state_mask) <<
+                interval_slot_bits) | index;
+        }
+
+        /* The time of the interval goes to the thread that ends it, which
+         * is the only writer of its accumulators */
+        void interval_end(uint64_t token) {
+            uint64_t end = now();
+            const std::atomic<thread_data*> * entry =
+                thread_index.find((uint32_t)(token >> 48));
+            thread_data * owner = entry == nullptr ? nullptr :
+                entry->load(std::memory_order_acquire);
+            uint32_t index = (uint32_t)token & (max_interval_slots - 1);
+            interval_slot * slot = owner == nullptr ? nullptr :
+                owner->_intervals.find(index);
+            if (slot == nullptr) {
+                return;
+            }
+            uint32_t state = slot->state.load(std::memory_order_acquire);
+            if ((state & 1) == 0 || (state & interval_state_mask) !=
+                ((token >> interval_slot_bits) & interval_state_mask)) {
+                return;
+            }
+            uint32_t id = slot->timer.load(std::memory_order_relaxed);
+            uint64_t start = slot->start.load(std::memory_order_relaxed);
+            if (!slot->state.compare_exchange_strong(state, state + 1,
+                std::memory_order_acq_rel)) {
+                return;
+            }
+            /* Only the owner takes slots off the closed list, and it takes
+             * all of them, so pushing doesn't suffer from ABA */
+            uint32_t head = owner->_closed_intervals.load(
+                std::memory_order_relaxed);
+            do {
+                slot->next.store(head, std::memory_order_relaxed);
+            } while (!owner->_closed_intervals.compare_exchange_weak(head,
+                index + 1, std::memory_order_release,
+                std::memory_order_relaxed));
+            thread_data * td = this_thread();
+            timer_values& v = td->_timers[id];
+            begin_update(td);
+            increment(v.calls, 1);
+            increment(v.sampled, 1);
+            increment(v.inclusive, end - start);
+            increment(v.exclusive, end - start);
+            end_update(td);
+            if (histograms) {
+                record(td->_timer_histograms, id, (double)(end - start), 1);
+            }
+        }
+
+        void deregister_thread(void) {
+            thread_data * td = my_thread;
+            if (td == nullptr) {
+                return;
+            }
+            /* Stop any timers the thread left running */
+            uint64_t end = now();
+            uint64_t hw_end[max_hw_counters];
+            read_counters(td, hw_end);
+            while (td->_depth > 0) {
+                pop(td, end, hw_end);
+            }
+            while (td->_phase_depth > 0) {
+                const phase_frame& f = td->_phases[--td->_phase_depth];
+                f.p->record(f.iteration, end - f.start);
+            }
+            /* The counters belong to the exiting thread */
+            delete td->_counters;
+            td->_counters = nullptr;
+            my_thread = nullptr;
+            std::lock_guard<std::mutex> guard(my_mutex);
+            for (size_t i = 0 ; i < profiler_list.size() ; i++) {
+                if (td->_timers.find(i) != nullptr) {
+                    td->_timers[i].skipped = 0;
+                }
+            }
+            free_threads.push_back(td);
+        }
+
+        void set_sampling(profiler * p, uint32_t period) {
+            p->_period.store(period > 1 ? period : 1,
+                std::memory_order_relaxed);
+        }
+
+        /* Calls a function from a background thread every interval, until
+         * it is stopped */
+        class periodic_thread {
+            public:
+                periodic_thread() : _thread(nullptr), _done(false) {}
+                void start(double seconds, void (*function)(void)) {
+                    _done = false;
+                    _thread = new std::thread(&periodic_thread::run, this,
+                        seconds, function);
+                }
+                /* Returns false if the thread wasn't running */
+                bool stop(void) {
+                    if (_thread == nullptr) {
+                        return false;
+                    }
+                    {
+                        std::lock_guard<std::mutex> guard(_mutex);
+                        _done = true;
+                    }
+                    _cv.notify_one();
+                    _thread->join();
+                    delete _thread;
+                    _thread = nullptr;
+                    return true;
+                }
+            private:
+                void run(double seconds, void (*function)(void)) {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    auto interval = std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(seconds));
+                    auto next = std::chrono::steady_clock::now() + interval;
+                    while (!_cv.wait_until(lock, next,
+                        [this]() { return _done; })) {
+                        function();
+                        /* don't try to catch up after a slow call */
+                        next = std::max(next + interval,
+                            std::chrono::steady_clock::now());
+                    }
+                }
+                std::mutex _mutex;
+                std::condition_variable _cv;
+                /* Never destroyed, so that a process that exits without
+                 * calling finalize doesn't terminate on a joinable thread */
+                std::thread * _thread;
+                bool _done;
+        };
+
+        /* Periodic snapshots, enabled by PS_TOOL_SNAPSHOT_INTERVAL (in
+         * seconds).  A background thread appends the timers and counters
+         * that changed since the previous snapshot to a text file, and
+         * flushes it, so the measurements survive if the process is
+         * killed.  Each snapshot is:
+         *
+         *   snapshot <number> <seconds since initialization>
+         *   timer_name <id> <name>               (for new timers)
+         *   counter_name <id> <name>             (for new counters)
+         *   timer <id> <thread> <calls> <inclusive ns> <exclusive ns>
+         *   counter <id> <thread> <samples> <mean> <m2> <min> <max>
+         *   end <number>
+         *
+         * The values are totals since the start, where m2 is the sum of
+         * the squared differences from the mean.  The accumulators are
+         * read with the threads' sequence locks, so the application
+         * threads are never blocked. */
+        struct timer_snapshot {
+            uint64_t calls;
+            uint64_t inclusive;
+            uint64_t exclusive;
+        };
+
+        struct counter_snapshot {
+            uint64_t count;
+            double mean;
+            double m2;
+            double min;
+            double max;
+        };
+
+        periodic_thread snapshot_thread;
+        std::string snapshot_filename;
+        FILE * snapshot_file{nullptr};
+        uint64_t snapshot_start{0};
+        uint64_t num_snapshots{0};
+        size_t timers_named{0};
+        size_t counters_named{0};
+        /* The values written last, by thread then id */
+        std::vector<std::vector<timer_snapshot> > last_timers;
+        std::vector<std::vector<counter_snapshot> > last_counters;
+
+        /* Only the lists are copied under the registry mutex, so that
+         * creating timers and threads doesn't wait for the file.  The
+         * accumulators are read without it, as the tables are never
+         * freed. */
+        void write_snapshot(void) {
+            std::vector<thread_data*> thread_list;
+            std::vector<std::string> timer_names;
+            std::vector<std::string> counter_names;
+            size_t num_timers, num_counters;
+            {
+                std::lock_guard<std::mutex> guard(my_mutex);
+                thread_list = threads;
+                num_timers = profiler_list.size();
+                num_counters = counter_list.size();
+                for (size_t i = timers_named ; i < num_timers ; i++) {
+                    timer_names.push_back(profiler_list[i]->name());
+                }
+                for (size_t i = counters_named ; i < num_counters ; i++) {
+                    counter_names.push_back(counter_list[i]->_name);
+                }
+            }
+            num_snapshots++;
+            fprintf(snapshot_file, "snapshot %llu %.6f\n",
+                (unsigned long long)num_snapshots,
+                (now() - snapshot_start) * 1.0e-9);
+            for (const auto& name : timer_names) {
+                fprintf(snapshot_file, "timer_name %zu %s\n", timers_named++,
+                    name.c_str());
+            }
+            for (const auto& name : counter_names) {
+                fprintf(snapshot_file, "counter_name %zu %s\n",
+                    counters_named++, name.c_str());
+            }
+            last_timers.resize(thread_list.size());
+            last_counters.resize(thread_list.size());
+            for (size_t t = 0 ; t < thread_list.size() ; t++) {
+                const thread_data * td = thread_list[t];
+                last_timers[t].resize(num_timers);
+                for (size_t i = 0 ; i < num_timers ; i++) {
+                    const timer_values * v = td->_timers.find(i);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    timer_snapshot current;
+                    read_consistent(td, [&]() {
+                        current.calls = v->calls.load(std::memory_order_relaxed);
+                        current.inclusive =
+                            v->inclusive.load(std::memory_order_relaxed);
+                        current.exclusive =
+                            v->exclusive.load(std::memory_order_relaxed);
+                    });
+                    timer_snapshot& last = last_timers[t][i];
+                    if (current.calls == last.calls &&
+                        current.exclusive == last.exclusive) {
+                        continue;
+                    }
+                    last = current;
+                    fprintf(snapshot_file, "timer %zu %zu %llu %llu %llu\n",
+                        i, t, (unsigned long long)current.calls,
+                        (unsigned long long)current.inclusive,
+                        (unsigned long long)current.exclusive);
+                }
+                last_counters[t].resize(num_counters);
+                for (size_t i = 0 ; i < num_counters ; i++) {
+                    const counter_values * v = td->_samples.find(i);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    counter_snapshot current;
+                    read_consistent(td, [&]() {
+                        current.count = v->count.load(std::memory_order_relaxed);
+                        current.mean = v->mean.load(std::memory_order_relaxed);
+                        current.m2 = v->m2.load(std::memory_order_relaxed);
+                        current.min = v->min.load(std::memory_order_relaxed);
+                        current.max = v->max.load(std::memory_order_relaxed);
+                    });
+                    counter_snapshot& last = last_counters[t][i];
+                    if (current.count == last.count) {
+                        continue;
+                    }
+                    last = current;
+                    fprintf(snapshot_file,
+                        "counter %zu %zu %llu %.17g %.17g %.17g %.17g\n",
+                        i, t, (unsigned long long)current.count, current.mean,
+                        current.m2, current.min, current.max);
+                }
+            }
+            fprintf(snapshot_file, "end %llu\n",
+                (unsigned long long)num_snapshots);
+            fflush(snapshot_file);
+        }
+
+        void snapshot_initialize(void) {
+            const char * interval = getenv("PS_TOOL_SNAPSHOT_INTERVAL");
+            if (interval == nullptr || atof(interval) <= 0.0) {
+                return;
+            }
+            const char * name = getenv("PS_TOOL_SNAPSHOT_FILE");
+            if (name != nullptr) {
+                snapshot_filename = name;
+            } else {
+                snapshot_filename = "perfstubs." + std::to_string(getpid()) +
+                    ".snapshot";
+            }
+            snapshot_file = fopen(snapshot_filename.c_str(), "w");
+            if (snapshot_file == nullptr) {
+                std::cerr << "Tool: unable to open " << snapshot_filename
+                          << ", snapshots disabled" << std::endl;
+                return;
+            }
+            snapshot_start = now();
+            snapshot_thread.start(atof(interval), write_snapshot);
+        }
+
+        /* Stop the thread, and write a last snapshot */
+        void snapshot_finalize(void) {
+            if (!snapshot_thread.stop()) {
+                return;
+            }
+            write_snapshot();
+            fclose(snapshot_file);
+            snapshot_file = nullptr;
+            cout << "Tool: wrote " << num_snapshots << " snapshots to "
+                 << snapshot_filename << endl;
+        }
+
+        /* The live profile in shared memory, enabled by PS_TOOL_SHM.  A
+         * publisher thread copies the timer totals of each thread into the
+         * region every PS_TOOL_SHM_INTERVAL seconds (see tool1_shm.h), so
+         * the timers themselves pay nothing for it.  Timers and threads
+         * beyond the size of the region aren't exported. */
+        periodic_thread shm_thread;
+        shm_region * shm{nullptr};
+        bool shm_keep{false};
+
+        /* As for the snapshots, only the lists are copied under the
+         * registry mutex */
+        void publish(void) {
+            shm_header * header = shm->header();
+            uint32_t named = header->num_timers.load(std::memory_order_relaxed);
+            std::vector<thread_data*> thread_list;
+            std::vector<std::string> timer_names;
+            {
+                std::lock_guard<std::mutex> guard(my_mutex);
+                thread_list.assign(threads.begin(), threads.begin() +
+                    std::min<size_t>(threads.size(), header->max_threads));
+                size_t num_timers = std::min<size_t>(profiler_list.size(),
+                    header->max_timers);
+                for (size_t i = named ; i < num_timers ; i++) {
+                    timer_names.push_back(profiler_list[i]->name());
+                }
+            }
+            uint32_t num_timers = named + timer_names.size();
+            for (uint32_t i = named ; i < num_timers ; i++) {
+                strncpy(shm->names()[i].name, timer_names[i - named].c_str(),
+                    shm_name_size - 1);
+            }
+            header->num_timers.store(num_timers, std::memory_order_release);
+            uint32_t num_threads = thread_list.size();
+            header->num_threads.store(num_threads, std::memory_order_release);
+            for (uint32_t t = 0 ; t < num_threads ; t++) {
+                const thread_data * td = thread_list[t];
+                for (uint32_t i = 0 ; i < num_timers ; i++) {
+                    const timer_values * v = td->_timers.find(i);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    shm_values current;
+                    read_consistent(td, [&]() {
+                        current.calls = v->calls.load(std::memory_order_relaxed);
+                        current.inclusive =
+                            v->inclusive.load(std::memory_order_relaxed);
+                        current.exclusive =
+                            v->exclusive.load(std::memory_order_relaxed);
+                    });
+                    const shm_slot * slot = shm->slot(i, t);
+                    if (slot->calls.load(std::memory_order_relaxed) !=
+                        current.calls || slot->exclusive.load(
+                        std::memory_order_relaxed) != current.exclusive) {
+                        shm->write(i, t, current);
+                    }
+                }
+            }
+            header->update_time.store(now(), std::memory_order_relaxed);
+            header->updates.store(header->updates.load(
+                std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        void shm_initialize(void) {
+            const char * enable = getenv("PS_TOOL_SHM");
+            if (enable == nullptr || atoi(enable) == 0) {
+                return;
+            }
+            std::string name(shm_default_name(getpid()));
+            const char * value = getenv("PS_TOOL_SHM_NAME");
+            if (value != nullptr && *value != '\0') {
+                name = value;
+            }
+            uint32_t max_timers = 1024;
+            value = getenv("PS_TOOL_SHM_TIMERS");
+            if (value != nullptr && atol(value) > 0) {
+                max_timers = (uint32_t)atol(value);
+            }
+            uint32_t max_threads = 64;
+            value = getenv("PS_TOOL_SHM_THREADS");
+            if (value != nullptr && atol(value) > 0) {
+                max_threads = (uint32_t)atol(value);
+            }
+            double interval = 0.1;
+            value = getenv("PS_TOOL_SHM_INTERVAL");
+            if (value != nullptr && atof(value) > 0.0) {
+                interval = atof(value);
+            }
+            value = getenv("PS_TOOL_SHM_KEEP");
+            shm_keep = value != nullptr && atoi(value) != 0;
+            shm = shm_region::create(name, max_timers, max_threads);
+            if (shm == nullptr) {
+                std::cerr << "Tool: unable to create /dev/shm/" << name
+                          << ", shared memory export disabled" << std::endl;
+                return;
+            }
+            shm_thread.start(interval, publish);
+        }
+
+        /* Publish the final values.  The region is removed, unless it was
+         * asked to outlive the process. */
+        void shm_finalize(void) {
+            if (!shm_thread.stop()) {
+                return;
+            }
+            publish();
+            if (!shm_keep) {
+                shm->unlink();
+            }
+            delete shm;
+            shm = nullptr;
+        }
+
+        void initialize(void) {
+            const char * period = getenv("PS_TOOL_SAMPLING_PERIOD");
+            if (period != nullptr && atol(period) > 1) {
+                default_period = (uint32_t)atol(period);
+            }
+            const char * throttle = getenv("PS_TOOL_THROTTLE");
+            if (throttle != nullptr && atoi(throttle) != 0) {
+                throttling = true;
+                const char * calls = getenv("PS_TOOL_THROTTLE_NUMCALLS");
+                if (calls != nullptr && atol(calls) > 0) {
+                    throttle_calls = (uint64_t)atol(calls);
+                }
+                /* in microseconds */
+                const char * percall = getenv("PS_TOOL_THROTTLE_PERCALL");
+                if (percall != nullptr && atol(percall) > 0) {
+                    throttle_ns = (uint64_t)atol(percall) * 1000;
+                }
+            }
+            const char * histogram = getenv("PS_TOOL_HISTOGRAMS");
+            if (histogram != nullptr && atoi(histogram) != 0) {
+                histograms = true;
+            }
+            const char * iterations = getenv("PS_TOOL_PHASE_ITERATIONS");
+            if (iterations != nullptr && atol(iterations) > 0) {
+                phase_iterations = (uint32_t)atol(iterations);
+            }
+            const char * cct = getenv("PS_TOOL_CALLPATH");
+            if (cct != nullptr && atoi(cct) != 0) {
+                callpath = true;
+            }
+            const char * profile = getenv("PS_TOOL_PROFILE");
+            if (profile != nullptr && strcmp(profile, "binary") == 0) {
+                binary_profile = true;
+                const char * name = getenv("PS_TOOL_PROFILE_FILE");
+                profile_filename = name != nullptr ? name :
+                    profile_default_name(getpid());
+            }
+            trace_initialize();
+            hw_counters_initialize();
+            snapshot_initialize();
+            shm_initialize();
+        }
+
+        void sample(counter * c, double value) {
+            thread_data * td = this_thread();
+            counter_values& v = td->_samples[c->_id];
+            begin_update(td);
+            uint64_t count = v.count.load(std::memory_order_relaxed) + 1;
+            double mean = v.mean.load(std::memory_order_relaxed);
+            double delta = value - mean;
+            mean += delta / (double)count;
+            v.m2.store(v.m2.load(std::memory_order_relaxed) +
+                delta * (value - mean), std::memory_order_relaxed);
+            v.mean.store(mean, std::memory_order_relaxed);
+            if (count == 1 || value < v.min.load(std::memory_order_relaxed)) {
+                v.min.store(value, std::memory_order_relaxed);
+            }
+            if (count == 1 || value > v.max.load(std::memory_order_relaxed)) {
+                v.max.store(value, std::memory_order_relaxed);
+            }
+            v.count.store(count, std::memory_order_relaxed);
+            end_update(td);
+            if (histograms) {
+                record(td->_counter_histograms, c->_id, value, 1);
+            }
+            if (tracing.load(std::memory_order_relaxed)) {
+                trace(td)->push(TRACE_COUNTER_SAMPLE, c->_id, now(), value);
+            }
+        }
+
+        /* The samples of one counter, merged over all threads.  Called
+         * with the registry mutex held. */
+        counter_summary merge_counter(uint32_t id) {
+            counter_summary total;
+            for (auto td : threads) {
+                const counter_values * v = td->_samples.find(id);
+                if (v != nullptr) {
+                    total.merge(counter_summary(*v));
+                }
+            }
+            return total;
+        }
+
+        void finalize(void) {
+            snapshot_finalize();
+            shm_finalize();
+            std::vector<std::string> timer_names;
+            std::vector<std::string> counter_names;
+            std::vector<std::string> phase_names;
+            {
+                std::lock_guard<std::mutex> guard(my_mutex);
+                for (auto p : profiler_list) {
+                    timer_names.push_back(p->name());
+                }
+                for (auto c : counter_list) {
+                    counter_names.push_back(c->_name);
+                }
+                for (auto p : phase_list) {
+                    phase_names.push_back(p->_name);
+                }
+            }
+            trace_finalize(timer_names, counter_names, phase_names);
+        }
+
+        /* A calling context, merged over the threads by its path from
+         * the root.  The values are kept per thread. */
+        struct callpath_node {
+            uint32_t timer;
+            size_t depth;
+            /* the timer names from the root, as "outer => inner" */
+            std::string path;
+            /* calls, sampled calls, inclusive and exclusive time, for
+             * each thread */
+            std::vector<uint64_t> values;
+            std::map<uint32_t, size_t> children;
+        };
+
+        static const size_t callpath_metrics = 4;
+
+        void merge_callpath(const thread_data * td, const cct_node * node,
+            size_t merged, std::vector<callpath_node>& paths) {
+            cct_for_each_child(node, [&](const cct_node * child) {
+                size_t index;
+                auto iter = paths[merged].children.find(child->timer);
+                if (iter != paths[merged].children.end()) {
+                    index = iter->second;
+                } else {
+                    index = paths.size();
+                    paths[merged].children[child->timer] = index;
+                    callpath_node p;
+                    p.timer = child->timer;
+                    p.depth = paths[merged].depth + 1;
+                    p.path = (merged == 0 ? std::string() :
+                        paths[merged].path + " => ") +
+                        profiler_list[child->timer]->name();
+                    p.values.resize(threads.size() * callpath_metrics);
+                    paths.push_back(std::move(p));
+                }
+                uint64_t * v = &paths[index].values[td->_id * callpath_metrics];
+                read_consistent(td, [&]() {
+                    v[0] = child->calls.load(std::memory_order_relaxed);
+                    v[1] = child->sampled.load(std::memory_order_relaxed);
+                    v[2] = child->inclusive.load(std::memory_order_relaxed);
+                    v[3] = child->exclusive.load(std::memory_order_relaxed);
+                });
+                merge_callpath(td, child, index, paths);
+            });
+        }
+
+        /* Merge the calling context trees of all threads.  The root comes
+         * first, and each context before its children.  Called with the
+         * registry mutex held. */
+        std::vector<callpath_node> merge_callpaths(void) {
+            std::vector<callpath_node> paths(1);
+            paths[0].timer = UINT32_MAX;
+            paths[0].depth = 0;
+            for (auto td : threads) {
+                if (td->_cct != nullptr) {
+                    merge_callpath(td, td->_cct, 0, paths);
+                }
+            }
+            return paths;
+        }
+
+        /* Write a context and, below it, its children by decreasing
+         * inclusive time */
+        void write_callpath(std::ostream& out,
+            const std::vector<callpath_node>& paths,
+            const std::vector<uint64_t>& totals, size_t index) {
+            if (index > 0) {
+                char line[64];
+                snprintf(line, sizeof(line), "%10llu %14.6f %14.6f  ",
+                    (unsigned long long)totals[index * callpath_metrics],
+                    totals[index * callpath_metrics + 2] * 1.0e-9,
+                    totals[index * callpath_metrics + 3] * 1.0e-9);
+                out << line << std::string(2 * (paths[index].depth - 1), ' ')
+                    << profiler_list[paths[index].timer]->name() << "\n";
+            }
+            std::vector<size_t> children;
+            for (const auto& child : paths[index].children) {
+                children.push_back(child.second);
+            }
+            std::stable_sort(children.begin(), children.end(),
+                [&](size_t a, size_t b) {
+                    return totals[a * callpath_metrics + 2] >
+                        totals[b * callpath_metrics + 2];
+                });
+            for (auto child : children) {
+                write_callpath(out, paths, totals, child);
+            }
+        }
+
+        /* Write the calling context tree, summed over all threads.  Called
+         * with the registry mutex held. */
+        void write_callpaths(std::ostream& out) {
+            std::vector<callpath_node> paths = merge_callpaths();
+            std::vector<uint64_t> totals(paths.size() * callpath_metrics);
+            for (size_t i = 1 ; i < paths.size() ; i++) {
+                for (size_t v = 0 ; v < paths[i].values.size() ; v++) {
+                    totals[i * callpath_metrics + v % callpath_metrics] +=
+                        paths[i].values[v];
+                }
+            }
+            out << "\nCall paths:\n"
+                << "     Calls   Inclusive(s)   Exclusive(s)  Name\n";
+            write_callpath(out, paths, totals, 0);
+        }
+
+        /* Write the summary of each dynamic phase.  Called with the
+         * registry mutex held. */
+        void write_phases(std::ostream& out) {
+            char line[128];
+            out << "\nPhases:\n"
+                   "Iterations      Calls       Total(s)        Mean(s)"
+                   "         Min(s)         Max(s)    Slowest  Name\n";
+            for (auto p : phase_list) {
+                uint64_t rolled;
+                int first, last;
+                phase_summary s = p->total(rolled, first, last);
+                snprintf(line, sizeof(line),
+                    "%10llu %10llu %14.6f %14.6f %14.6f %14.6f %10d  ",
+                    (unsigned long long)s.iterations,
+                    (unsigned long long)s.calls, s.time * 1.0e-9,
+                    s.iterations > 0 ? s.time * 1.0e-9 / s.iterations : 0.0,
+                    s.iterations > 0 ? s.min * 1.0e-9 : 0.0,
+                    s.max * 1.0e-9, s.slowest);
+                out << line << p->_name;
+                if (rolled > 0 && first <= last) {
+                    out << "  [" << rolled << " rolled up, iterations "
+                        << first << "-" << last << " kept]";
+                }
+                out << "\n";
+            }
+        }
+
+        /* Write the median and tail quantiles of the merged histograms.
+         * Called with the registry mutex held. */
+        void write_quantiles(std::ostream& out) {
+            std::vector<uint64_t> counts(histogram::num_buckets);
+            char line[128];
+            const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+            out << "\nTimer quantiles:\n"
+                   "        p50(s)        p90(s)        p99(s)      p99.9(s)  Name\n";
+            for (auto p : profiler_list) {
+                merge_histograms(&thread_data::_timer_histograms, p->_id,
+                    counts.data());
+                for (auto q : quantiles) {
+                    snprintf(line, sizeof(line), " %13.6g",
+                        histogram::quantile(counts.data(), q) * 1.0e-9);
+                    out << line;
+                }
+                out << "  " << p->name() << "\n";
+            }
+            out << "\nCounter quantiles:\n"
+                   "           p50           p90           p99         p99.9  Name\n";
+            for (auto c : counter_list) {
+                merge_histograms(&thread_data::_counter_histograms, c->_id,
+                    counts.data());
+                for (auto q : quantiles) {
+                    snprintf(line, sizeof(line), " %13.6g",
+                        histogram::quantile(counts.data(), q));
+                    out << line;
+                }
+                out << "  " << c->_name << "\n";
+            }
+        }
+
+        /* Write the profile, summed over all threads */
+        void write_profile(std::ostream& out) {
+            std::lock_guard<std::mutex> guard(my_mutex);
+            std::vector<std::pair<uint64_t,uint64_t> > calls_inclusive(
+                profiler_list.size());
+            std::vector<uint64_t> exclusive(profiler_list.size());
+            std::vector<uint64_t> sampled(profiler_list.size());
+            std::vector<uint64_t> hw_exclusive(
+                profiler_list.size() * num_hw_counters);
+            for (auto td : threads) {
+                for (size_t i = 0 ; i < profiler_list.size() ; i++) {
+                    const timer_values * v = td->_timers.find(i);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    calls_inclusive[i].first +=
+                        v->calls.load(std::memory_order_relaxed);
+                    calls_inclusive[i].second +=
+                        v->inclusive.load(std::memory_order_relaxed);
+                    exclusive[i] += v->exclusive.load(std::memory_order_relaxed);
+                    sampled[i] += v->sampled.load(std::memory_order_relaxed);
+                    const hw_values * h = td->_hw.find(i);
+                    for (size_t c = 0 ; h != nullptr &&
+                        c < num_hw_counters ; c++) {
+                        hw_exclusive[i * num_hw_counters + c] +=
+                            h->exclusive[c].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+            std::vector<size_t> order(profiler_list.size());
+            for (size_t i = 0 ; i < order.size() ; i++) {
+                order[i] = i;
+            }
+            std::stable_sort(order.begin(), order.end(),
+                [&](size_t a, size_t b) {
+                    return calls_inclusive[a].second > calls_inclusive[b].second;
+                });
+            char line[64];
+            out << "     Calls   Inclusive(s)   Exclusive(s)  Name\n";
+            for (auto i : order) {
+                snprintf(line, sizeof(line), "%10llu %14.6f %14.6f  ",
+                    (unsigned long long)calls_inclusive[i].first,
+                    calls_inclusive[i].second * 1.0e-9, exclusive[i] * 1.0e-9);
+                out << line << profiler_list[i]->name();
+                if (sampled[i] < calls_inclusive[i].first) {
+                    out << "  [sampled " << sampled[i] << "/"
+                        << calls_inclusive[i].first << "]";
+                }
+                if (profiler_list[i]->_throttled.load(
+                    std::memory_order_relaxed)) {
+                    out << "  [throttled]";
+                }
+                out << "\n";
+            }
+            if (num_hw_counters > 0) {
+                out << "\nExclusive hardware counts:\n";
+                for (const auto& name : hw_counter_names()) {
+                    snprintf(line, sizeof(line), "%24s", name.c_str());
+                    out << line;
+                }
+                out << "  Name\n";
+                for (auto i : order) {
+                    for (size_t c = 0 ; c < num_hw_counters ; c++) {
+                        snprintf(line, sizeof(line), "%24llu",
+                            (unsigned long long)hw_exclusive[
+                            i * num_hw_counters + c]);
+                        out << line;
+                    }
+                    out << "  " << profiler_list[i]->name() << "\n";
+                }
+            }
+            if (!counter_list.empty()) {
+                out << "\n   Samples           Mean         StdDev"
+                       "            Min            Max  Name\n";
+                char counter_line[128];
+                for (auto c : counter_list) {
+                    counter_summary total = merge_counter(c->_id);
+                    snprintf(counter_line, sizeof(counter_line),
+                        "%10llu %14.4f %14.4f %14.4f %14.4f  ",
+                        (unsigned long long)total.count, total.mean,
+                        sqrt(total.variance()), total.min, total.max);
+                    out << counter_line << c->_name << "\n";
+                }
+            }
+            if (!phase_list.empty()) {
+                write_phases(out);
+            }
+            if (callpath) {
+                write_callpaths(out);
+            }
+            if (histograms) {
+                write_quantiles(out);
+            }
+            out << std::flush;
+        }
+
+        /* Merge the per-thread tables.  The values are ordered by timer,
+         * then thread, then metric.  Called with the registry mutex held,
+         * for a query or a binary dump. */
+        void fill_timer_data(ps_tool_timer_data_t *timer_data) {
+            memset(timer_data, 0, sizeof(ps_tool_timer_data_t));
+            /* The calling contexts below the outermost timers follow the
+             * timers, named by their path */
+            std::vector<callpath_node> paths;
+            std::vector<size_t> nested;
+            if (callpath) {
+                paths = merge_callpaths();
+                for (size_t p = 1 ; p < paths.size() ; p++) {
+                    if (paths[p].depth > 1) {
+                        nested.push_back(p);
+                    }
+                }
+            }
+            unsigned int num_flat = profiler_list.size();
+            unsigned int num_timers = num_flat + nested.size();
+            unsigned int num_threads = threads.size();
+            unsigned int num_metrics = 4 + 2 * num_hw_counters;
+            timer_data->num_timers = num_timers;
+            timer_data->num_threads = num_threads;
+            timer_data->num_metrics = num_metrics;
+            timer_data->timer_names = (char **)(calloc(num_timers, sizeof(char *)));
+            timer_data->metric_names = (char **)(calloc(num_metrics, sizeof(char *)));
+            timer_data->values = (double *)(calloc(
+                (size_t)num_timers * num_threads * num_metrics, sizeof(double)));
+            /* Times are in seconds */
+            timer_data->metric_names[0] = strdup("Calls");
+            timer_data->metric_names[1] = strdup("Inclusive Time");
+            timer_data->metric_names[2] = strdup("Exclusive Time");
+            /* The times are extrapolated from the sampled calls */
+            timer_data->metric_names[3] = strdup("Sampled Calls");
+            /* Followed by the inclusive and exclusive count of each hardware
+             * counter */
+            const std::vector<std::string>& hw_names = hw_counter_names();
+            for (size_t c = 0 ; c < num_hw_counters ; c++) {
+                timer_data->metric_names[4 + 2 * c] =
+                    strdup(("Inclusive " + hw_names[c]).c_str());
+                timer_data->metric_names[5 + 2 * c] =
+                    strdup(("Exclusive " + hw_names[c]).c_str());
+            }
+            for (unsigned int i = 0 ; i < num_flat ; i++) {
+                timer_data->timer_names[i] =
+                    strdup(profiler_list[i]->name().c_str());
+                for (unsigned int t = 0 ; t < num_threads ; t++) {
+                    const timer_values * v =
+                        threads[t]->_timers.find(i);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    size_t index = ((size_t)i * num_threads + t) * num_metrics;
+                    timer_data->values[index] =
+                        (double)v->calls.load(std::memory_order_relaxed);
+                    timer_data->values[index + 1] =
+                        v->inclusive.load(std::memory_order_relaxed) * 1.0e-9;
+                    timer_data->values[index + 2] =
+                        v->exclusive.load(std::memory_order_relaxed) * 1.0e-9;
+                    timer_data->values[index + 3] =
+                        (double)v->sampled.load(std::memory_order_relaxed);
+                    const hw_values * h = threads[t]->_hw.find(i);
+                    for (size_t c = 0 ; h != nullptr &&
+                        c < num_hw_counters ; c++) {
+                        timer_data->values[index + 4 + 2 * c] =
+                            (double)h->inclusive[c].load(std::memory_order_relaxed);
+                        timer_data->values[index + 5 + 2 * c] =
+                            (double)h->exclusive[c].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+            /* The hardware counts are only kept per timer */
+            for (size_t n = 0 ; n < nested.size() ; n++) {
+                const callpath_node& p = paths[nested[n]];
+                unsigned int i = num_flat + n;
+                timer_data->timer_names[i] = strdup(p.path.c_str());
+                for (unsigned int t = 0 ; t < num_threads ; t++) {
+                    const uint64_t * v = &p.values[t * callpath_metrics];
+                    size_t index = ((size_t)i * num_threads + t) * num_metrics;
+                    timer_data->values[index] = (double)v[0];
+                    timer_data->values[index + 1] = v[2] * 1.0e-9;
+                    timer_data->values[index + 2] = v[3] * 1.0e-9;
+                    timer_data->values[index + 3] = (double)v[1];
+                }
+            }
+        }
+
+        /* The values are ordered by counter, then thread.  Called with the
+         * registry mutex held. */
+        void fill_counter_data(ps_tool_counter_data_t *counter_data) {
+            memset(counter_data, 0, sizeof(ps_tool_counter_data_t));
+            unsigned int num_counters = counter_list.size();
+            unsigned int num_threads = threads.size();
+            size_t size = (size_t)num_counters * num_threads;
+            counter_data->num_counters = num_counters;
+            counter_data->num_threads = num_threads;
+            counter_data->counter_names = (char **)(calloc(num_counters, sizeof(char *)));
+            counter_data->num_samples = (double *)(calloc(size, sizeof(double)));
+            counter_data->value_total = (double *)(calloc(size, sizeof(double)));
+            counter_data->value_min = (double *)(calloc(size, sizeof(double)));
+            counter_data->value_max = (double *)(calloc(size, sizeof(double)));
+            counter_data->value_sumsqr = (double *)(calloc(size, sizeof(double)));
+            for (unsigned int i = 0 ; i < num_counters ; i++) {
+                counter_data->counter_names[i] =
+                    strdup(counter_list[i]->_name.c_str());
+                for (unsigned int t = 0 ; t < num_threads ; t++) {
+                    const counter_values * v =
+                        threads[t]->_samples.find(i);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    counter_summary s(*v);
+                    size_t index = (size_t)i * num_threads + t;
+                    counter_data->num_samples[index] = (double)s.count;
+                    counter_data->value_total[index] = s.mean * s.count;
+                    counter_data->value_min[index] = s.min;
+                    counter_data->value_max[index] = s.max;
+                    /* the sum of the squares of the values */
+                    counter_data->value_sumsqr[index] =
+                        s.m2 + s.mean * s.mean * s.count;
+                }
+            }
+        }
+
+        /* Write the binary profile, see tool1_profile.h.  Each dump
+         * replaces the previous one. */
+        void write_binary_profile(void) {
+            ps_tool_timer_data_t timer_data;
+            ps_tool_counter_data_t counter_data;
+            {
+                std::lock_guard<std::mutex> guard(my_mutex);
+                fill_timer_data(&timer_data);
+                fill_counter_data(&counter_data);
+            }
+            if (profile_write(profile_filename, timer_data, counter_data)) {
+                std::cout << "Tool: wrote the profile to " << profile_filename
+                          << std::endl;
+            } else {
+                std::cerr << "Tool: unable to write " << profile_filename
+                          << ": " << strerror(errno) << std::endl;
+            }
+            profile_free(&timer_data, &counter_data);
+        }
+
     }
 }
 
@@ -70,21 +1834,43 @@ extern "C"
 {
 
     // On some systems, can't write output during pre-initialization
-    void ps_tool_initialize(void) { /* cout << "Tool: " << __func__ << endl; */ }
+    void ps_tool_initialize(void)
+    {
+        /* cout << "Tool: " << __func__ << endl; */
+        MINE::initialize();
+    }
 
     // On some systems, can't write output during pre-initialization
     void ps_tool_register_thread(void)
     {
         /* cout << "Tool: " << __func__ << endl; */
+        MINE::this_thread();
     }
 
-    void ps_tool_finalize(void) { cout << "Tool: " << __func__ << endl; }
+    void ps_tool_deregister_thread(void)
+    {
+        MINE::deregister_thread();
+    }
+
+    void ps_tool_finalize(void)
+    {
+        cout << "Tool: " << __func__ << endl;
+        MINE::finalize();
+    }
 
     void ps_tool_pause_measurement(void) { cout << "Tool: " << __func__ << endl; MINE::enabled = false; }
 
     void ps_tool_resume_measurement(void) { cout << "Tool: " << __func__ << endl; MINE::enabled = true; }
 
-    void ps_tool_dump_data(void) { cout << "Tool: " << __func__ << endl; }
+    void ps_tool_dump_data(void)
+    {
+        cout << "Tool: " << __func__ << endl;
+        if (MINE::binary_profile) {
+            MINE::write_binary_profile();
+        } else {
+            MINE::write_profile(cout);
+        }
+    }
 
     void * ps_tool_timer_create(const char * timer_name)
     {
@@ -92,33 +1878,49 @@ extern "C"
         return MINE::find_timer(timer_name);
     }
 
+    void * ps_tool_timer_create_location(const char * file,
+        const char * func, int line)
+    {
+        cout << "Tool: " << __func__ << " " << func << " " << file
+             << ":" << line << endl;
+        return MINE::find_timer(file, func, line);
+    }
+
     void ps_tool_timer_start(void *profiler)
     {
         MINE::profiler * p = (MINE::profiler *) profiler;
-        cout << "Tool: " << __func__ << " " << p->_name << endl;
-        p->start();
+        if (p != nullptr) {
+            MINE::start(p);
+        }
     }
 
     void ps_tool_timer_stop(void *profiler)
     {
         MINE::profiler* p = (MINE::profiler*) profiler;
-        cout << "Tool: " << __func__ << " " << p->_name << endl;
-        p->stop();
+        if (p != nullptr) {
+            MINE::stop(p);
+        }
     }
 
     void ps_tool_start_string(const char * timer_name)
     {
-        cout << "Tool: " << __func__ << " " << timer_name << endl;
+        MINE::profiler * p = (MINE::profiler *) MINE::find_timer(timer_name);
+        if (p != nullptr) {
+            MINE::start(p);
+        }
     }
 
     void ps_tool_stop_string(const char * timer_name)
     {
-        cout << "Tool: " << __func__ << " " << timer_name << endl;
+        MINE::profiler * p = (MINE::profiler *) MINE::find_timer(timer_name);
+        if (p != nullptr) {
+            MINE::stop(p);
+        }
     }
 
     void ps_tool_stop_current(void)
     {
-        cout << "Tool: " << __func__ << " " << endl;
+        MINE::stop_current();
     }
 
     void ps_tool_set_parameter(const char *parameter_name, int64_t parameter_value)
@@ -130,15 +1932,13 @@ extern "C"
     void ps_tool_dynamic_phase_start(const char *phase_prefix,
                                       int iteration_index)
     {
-        cout << "Tool: " << __func__ << " " << phase_prefix << ", "
-             << iteration_index << endl;
+        MINE::phase_start(phase_prefix, iteration_index);
     }
 
     void ps_tool_dynamic_phase_stop(const char *phase_prefix,
                                      int iteration_index)
     {
-        cout << "Tool: " << __func__ << " " << phase_prefix << ", "
-             << iteration_index << endl;
+        MINE::phase_stop(phase_prefix, iteration_index);
     }
 
     void* ps_tool_create_counter(const char *counter_name)
@@ -150,8 +1950,9 @@ extern "C"
     void ps_tool_sample_counter(void *counter, double value)
     {
         MINE::counter* c = (MINE::counter*) counter;
-        cout << "Tool: " << __func__ << " " << c->_name << " = " << value
-             << endl;
+        if (c != nullptr) {
+            MINE::sample(c, value);
+        }
     }
 
     void ps_tool_set_metadata(const char *name, const char *value)
@@ -159,24 +1960,30 @@ extern "C"
         cout << "Tool: " << __func__ << " " << name << " = " << value << endl;
     }
 
+    uint64_t ps_tool_interval_begin(void *profiler)
+    {
+        MINE::profiler* p = (MINE::profiler*) profiler;
+        return p != nullptr ? MINE::interval_begin(p) : 0;
+    }
+
+    void ps_tool_interval_end(uint64_t token)
+    {
+        MINE::interval_end(token);
+    }
+
+    void ps_tool_set_sampling(void *profiler, unsigned int period)
+    {
+        MINE::profiler* p = (MINE::profiler*) profiler;
+        if (p != nullptr) {
+            MINE::set_sampling(p, period);
+        }
+    }
+
     void ps_tool_get_timer_data(ps_tool_timer_data_t *timer_data)
     {
         cout << "Tool: " << __func__ << endl;
-        memset(timer_data, 0, sizeof(ps_tool_timer_data_t));
-        timer_data->num_timers = 1;
-        timer_data->num_threads = 1;
-        timer_data->num_metrics = 3;
-        timer_data->timer_names = (char **)(calloc(1, sizeof(char *)));
-        timer_data->metric_names = (char **)(calloc(3, sizeof(char *)));
-        timer_data->values = (double *)(calloc(3, sizeof(double)));
-        timer_data->timer_names[0] = strdup("Main Timer");
-        timer_data->metric_names[0] = strdup("Calls");
-        timer_data->metric_names[1] = strdup("Inclusive Time");
-        timer_data->metric_names[2] = strdup("Exclusive Time");
-        timer_data->values[0] = 1.0;
-        timer_data->values[1] = 20.0;
-        timer_data->values[2] = 10.0;
-        return;
+        std::lock_guard<std::mutex> guard(MINE::my_mutex);
+        MINE::fill_timer_data(timer_data);
     }
 
     void ps_tool_free_timer_data(ps_tool_timer_data_t *timer_data)
@@ -187,11 +1994,19 @@ extern "C"
         }
         if (timer_data->timer_names != nullptr)
         {
+            for (unsigned int i = 0 ; i < timer_data->num_timers ; i++)
+            {
+                free(timer_data->timer_names[i]);
+            }
             free(timer_data->timer_names);
             timer_data->timer_names = nullptr;
         }
         if (timer_data->metric_names != nullptr)
         {
+            for (unsigned int i = 0 ; i < timer_data->num_metrics ; i++)
+            {
+                free(timer_data->metric_names[i]);
+            }
             free(timer_data->metric_names);
             timer_data->metric_names = nullptr;
         }
@@ -205,22 +2020,8 @@ extern "C"
     void ps_tool_get_counter_data(ps_tool_counter_data_t *counter_data)
     {
         cout << "Tool: " << __func__ << endl;
-        memset(counter_data, 0, sizeof(ps_tool_counter_data_t));
-        counter_data->num_counters = 1;
-        counter_data->num_threads = 1;
-        counter_data->counter_names = (char **)(calloc(1, sizeof(char *)));
-        counter_data->num_samples = (double *)(calloc(1, sizeof(double)));
-        counter_data->value_total = (double *)(calloc(1, sizeof(double)));
-        counter_data->value_min = (double *)(calloc(1, sizeof(double)));
-        counter_data->value_max = (double *)(calloc(1, sizeof(double)));
-        counter_data->value_sumsqr = (double *)(calloc(1, sizeof(double)));
-        counter_data->counter_names[0] = strdup("A Counter");
-        counter_data->num_samples[0] = 3.0;
-        counter_data->value_total[0] = 6.0;
-        counter_data->value_min[0] = 1.0;
-        counter_data->value_max[0] = 3.0;
-        counter_data->value_sumsqr[0] = 1.414213562373095;
-        return;
+        std::lock_guard<std::mutex> guard(MINE::my_mutex);
+        MINE::fill_counter_data(counter_data);
     }
 
     void ps_tool_free_counter_data(ps_tool_counter_data_t *counter_data)
@@ -231,6 +2032,10 @@ extern "C"
         }
         if (counter_data->counter_names != nullptr)
         {
+            for (unsigned int i = 0 ; i < counter_data->num_counters ; i++)
+            {
+                free(counter_data->counter_names[i]);
+            }
             free(counter_data->counter_names);
             counter_data->counter_names = nullptr;
         }
@@ -261,6 +2066,90 @@ extern "C"
         }
     }
 
+    /* The histograms of the timers (in seconds) or of the counters, per
+     * thread.  Empty unless PS_TOOL_HISTOGRAMS is set. */
+    static void get_histograms(ps_tool_histogram_data_t *histogram_data,
+        bool timers)
+    {
+        memset(histogram_data, 0, sizeof(ps_tool_histogram_data_t));
+        if (!MINE::histograms) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(MINE::my_mutex);
+        unsigned int num_histograms = timers ? MINE::profiler_list.size() :
+            MINE::counter_list.size();
+        unsigned int num_threads = MINE::threads.size();
+        unsigned int num_buckets = MINE::histogram::num_buckets;
+        double scale = timers ? 1.0e-9 : 1.0;
+        histogram_data->num_histograms = num_histograms;
+        histogram_data->num_threads = num_threads;
+        histogram_data->num_buckets = num_buckets;
+        histogram_data->names = (char **)(calloc(num_histograms, sizeof(char *)));
+        histogram_data->bucket_lower = (double *)(calloc(num_buckets, sizeof(double)));
+        histogram_data->bucket_upper = (double *)(calloc(num_buckets, sizeof(double)));
+        histogram_data->counts = (double *)(calloc(
+            (size_t)num_histograms * num_threads * num_buckets, sizeof(double)));
+        for (unsigned int b = 0 ; b < num_buckets ; b++) {
+            histogram_data->bucket_lower[b] = MINE::histogram::lower(b) * scale;
+            histogram_data->bucket_upper[b] = MINE::histogram::upper(b) * scale;
+        }
+        for (unsigned int i = 0 ; i < num_histograms ; i++) {
+            histogram_data->names[i] = strdup(timers ?
+                MINE::profiler_list[i]->name().c_str() :
+                MINE::counter_list[i]->_name.c_str());
+            for (unsigned int t = 0 ; t < num_threads ; t++) {
+                const MINE::histogram_slot * slot = timers ?
+                    MINE::threads[t]->_timer_histograms.find(i) :
+                    MINE::threads[t]->_counter_histograms.find(i);
+                const MINE::histogram * h = slot == nullptr ? nullptr :
+                    slot->load(std::memory_order_acquire);
+                if (h == nullptr) {
+                    continue;
+                }
+                double * counts = histogram_data->counts +
+                    ((size_t)i * num_threads + t) * num_buckets;
+                for (unsigned int b = 0 ; b < num_buckets ; b++) {
+                    counts[b] = (double)h->count(b);
+                }
+            }
+        }
+    }
+
+    void ps_tool_get_timer_histogram(ps_tool_histogram_data_t *histogram_data)
+    {
+        cout << "Tool: " << __func__ << endl;
+        get_histograms(histogram_data, true);
+    }
+
+    void ps_tool_get_counter_histogram(ps_tool_histogram_data_t *histogram_data)
+    {
+        cout << "Tool: " << __func__ << endl;
+        get_histograms(histogram_data, false);
+    }
+
+    void ps_tool_free_histogram_data(ps_tool_histogram_data_t *histogram_data)
+    {
+        if (histogram_data == nullptr)
+        {
+            return;
+        }
+        if (histogram_data->names != nullptr)
+        {
+            for (unsigned int i = 0 ; i < histogram_data->num_histograms ; i++)
+            {
+                free(histogram_data->names[i]);
+            }
+            free(histogram_data->names);
+            histogram_data->names = nullptr;
+        }
+        free(histogram_data->bucket_lower);
+        histogram_data->bucket_lower = nullptr;
+        free(histogram_data->bucket_upper);
+        histogram_data->bucket_upper = nullptr;
+        free(histogram_data->counts);
+        histogram_data->counts = nullptr;
+    }
+
     void ps_tool_get_metadata(ps_tool_metadata_t *metadata)
     {
         cout << "Tool: " << __func__ << endl;
@@ -335,6 +2224,14 @@ static void initme(void) {
         data.free_timer_data = &ps_tool_free_timer_data;
         data.free_counter_data = &ps_tool_free_counter_data;
         data.free_metadata = &ps_tool_free_metadata;
+        data.deregister_thread = &ps_tool_deregister_thread;
+        data.set_sampling = &ps_tool_set_sampling;
+        data.timer_create_location = &ps_tool_timer_create_location;
+        data.get_timer_histogram = &ps_tool_get_timer_histogram;
+        data.get_counter_histogram = &ps_tool_get_counter_histogram;
+        data.free_histogram_data = &ps_tool_free_histogram_data;
+        data.interval_begin = &ps_tool_interval_begin;
+        data.interval_end = &ps_tool_interval_end;
         tool_id = reg_function(&data);
     }
 }
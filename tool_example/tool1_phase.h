@@ -0,0 +1,141 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Dynamic phases for the reference tool (ps_dynamic_phase_start_).
+ *
+ * Each phase prefix has one descriptor, with a record per iteration, kept in
+ * chunks found directly from the iteration index, so recording an iteration
+ * doesn't build a name or create a timer.  Only about the last
+ * max_iterations iterations (PS_TOOL_PHASE_ITERATIONS) are kept: the chunks
+ * form a ring, and when an iteration needs the place of an older chunk, the
+ * iterations of that chunk are rolled up into the summary of the phase and
+ * the chunk is reused.  The memory of a phase is bounded by the ring, and
+ * nothing is allocated once it is full.
+ *
+ * Phases mark the coarse steps of a program, such as time steps, so a
+ * descriptor is updated under its own mutex, once for each stop. */
+
+namespace external {
+    namespace ps_implementation {
+
+        struct phase_record {
+            uint64_t calls;
+            uint64_t time;
+        };
+
+        /* Totals over iterations.  The iterations that are recorded after
+         * they were rolled up (or with a negative index) only add their
+         * calls and time. */
+        struct phase_summary {
+            uint64_t iterations{0};
+            uint64_t calls{0};
+            uint64_t time{0};
+            uint64_t min{UINT64_MAX};
+            uint64_t max{0};
+            int slowest{-1};
+            void add(int iteration, const phase_record& r) {
+                if (r.calls == 0) {
+                    return;
+                }
+                iterations++;
+                calls += r.calls;
+                time += r.time;
+                min = std::min(min, r.time);
+                if (r.time >= max) {
+                    max = r.time;
+                    slowest = iteration;
+                }
+            }
+        };
+
+        class phase {
+            public:
+                static const uint32_t chunk_size = 256;
+                phase(const std::string& name, uint32_t id,
+                    uint32_t max_iterations) : _name(name), _id(id),
+                    _chunks(std::max<uint32_t>(1,
+                        (max_iterations + chunk_size - 1) / chunk_size),
+                        nullptr) {}
+                const std::string _name;
+                const uint32_t _id;
+
+                void record(int iteration, uint64_t time) {
+                    std::lock_guard<std::mutex> guard(_mutex);
+                    phase_record * r = find(iteration);
+                    if (r == nullptr) {
+                        _summary.calls++;
+                        _summary.time += time;
+                        return;
+                    }
+                    r->calls++;
+                    r->time += time;
+                }
+
+                /* The summary of all iterations, the number that were
+                 * rolled up and the range of those still kept (first >
+                 * last if there are none) */
+                phase_summary total(uint64_t& rolled, int& first, int& last) {
+                    std::lock_guard<std::mutex> guard(_mutex);
+                    phase_summary s = _summary;
+                    rolled = _summary.iterations;
+                    first = INT32_MAX;
+                    last = INT32_MIN;
+                    for (const chunk * c : _chunks) {
+                        for (uint32_t i = 0 ; c != nullptr &&
+                            i < chunk_size ; i++) {
+                            if (c->records[i].calls == 0) {
+                                continue;
+                            }
+                            s.add(c->base + (int)i, c->records[i]);
+                            first = std::min(first, c->base + (int)i);
+                            last = std::max(last, c->base + (int)i);
+                        }
+                    }
+                    return s;
+                }
+
+            private:
+                struct chunk {
+                    int base;
+                    phase_record records[chunk_size];
+                };
+
+                /* The record of an iteration, or nullptr if it is older
+                 * than the chunk in its place in the ring */
+                phase_record * find(int iteration) {
+                    if (iteration < 0) {
+                        return nullptr;
+                    }
+                    int base = iteration - iteration % (int)chunk_size;
+                    chunk *& c = _chunks[(iteration / chunk_size) %
+                        _chunks.size()];
+                    if (c == nullptr) {
+                        c = new chunk();
+                        c->base = base;
+                    } else if (c->base > base) {
+                        return nullptr;
+                    } else if (c->base < base) {
+                        for (uint32_t i = 0 ; i < chunk_size ; i++) {
+                            _summary.add(c->base + (int)i, c->records[i]);
+                            c->records[i] = phase_record();
+                        }
+                        c->base = base;
+                    }
+                    return &c->records[iteration % chunk_size];
+                }
+
+                std::mutex _mutex;
+                std::vector<chunk*> _chunks;
+                phase_summary _summary;
+        };
+    }
+}
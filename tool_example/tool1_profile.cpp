@@ -0,0 +1,275 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#include "tool1_profile.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace external {
+    namespace ps_implementation {
+
+        namespace {
+            void add_string(std::vector<char>& strings, const char * s) {
+                if (s == nullptr) {
+                    s = "";
+                }
+                strings.insert(strings.end(), s, s + strlen(s) + 1);
+            }
+
+            /* a * b <= limit, without overflowing */
+            bool fits(uint64_t a, uint64_t b, uint64_t limit) {
+                return b == 0 || a <= limit / b;
+            }
+
+            /* Copy the next string of the table, false if it isn't
+             * terminated inside the table */
+            bool next_string(const char *& s, const char * end, char ** out) {
+                const char * nul = (const char *)memchr(s, '\0', end - s);
+                if (nul == nullptr) {
+                    return false;
+                }
+                *out = strdup(s);
+                s = nul + 1;
+                return true;
+            }
+        }
+
+        bool profile_write(const std::string& path,
+            const ps_tool_timer_data_t& timer_data,
+            const ps_tool_counter_data_t& counter_data) {
+            std::vector<char> strings;
+            for (unsigned int i = 0 ; i < timer_data.num_metrics ; i++) {
+                add_string(strings, timer_data.metric_names[i]);
+            }
+            for (unsigned int i = 0 ; i < timer_data.num_timers ; i++) {
+                add_string(strings, timer_data.timer_names[i]);
+            }
+            for (unsigned int i = 0 ; i < counter_data.num_counters ; i++) {
+                add_string(strings, counter_data.counter_names[i]);
+            }
+            strings.resize((strings.size() + 7) & ~(size_t)7, '\0');
+
+            /* The counters are reported for the threads that existed when
+             * they were queried, use the timers' count for both */
+            uint32_t num_threads = timer_data.num_threads;
+            size_t timer_values = (size_t)timer_data.num_timers *
+                num_threads * timer_data.num_metrics;
+            size_t counter_values = (size_t)counter_data.num_counters *
+                num_threads;
+            std::vector<char> buffer(sizeof(profile_header) + strings.size() +
+                (timer_values + profile_counter_columns * counter_values) *
+                sizeof(double));
+
+            profile_header * header = (profile_header *)buffer.data();
+            memcpy(header->magic, "PSPROF", 7);
+            header->version = profile_version;
+            header->byte_order = profile_byte_order;
+            header->header_size = sizeof(profile_header);
+            header->num_metrics = timer_data.num_metrics;
+            header->num_timers = timer_data.num_timers;
+            header->num_threads = num_threads;
+            header->num_counters = counter_data.num_counters;
+            header->pid = (uint64_t)getpid();
+            header->strings_size = strings.size();
+            char * p = buffer.data() + sizeof(profile_header);
+            memcpy(p, strings.data(), strings.size());
+            p += strings.size();
+            if (timer_values > 0) {
+                memcpy(p, timer_data.values, timer_values * sizeof(double));
+                p += timer_values * sizeof(double);
+            }
+            const double * columns[profile_counter_columns] = {
+                counter_data.num_samples, counter_data.value_total,
+                counter_data.value_min, counter_data.value_max,
+                counter_data.value_sumsqr};
+            for (uint32_t c = 0 ; c < profile_counter_columns ; c++) {
+                if (counter_values == 0) {
+                    break;
+                }
+                /* fewer threads may have been seen by the counter query */
+                size_t rows = std::min(num_threads, counter_data.num_threads);
+                for (unsigned int i = 0 ; i < counter_data.num_counters ; i++) {
+                    memcpy(p + (size_t)i * num_threads * sizeof(double),
+                        columns[c] + (size_t)i * counter_data.num_threads,
+                        rows * sizeof(double));
+                }
+                p += counter_values * sizeof(double);
+            }
+
+            std::string temporary(path + ".tmp");
+            int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                0644);
+            if (fd < 0) {
+                return false;
+            }
+            const char * data = buffer.data();
+            size_t left = buffer.size();
+            while (left > 0) {
+                ssize_t written = ::write(fd, data, left);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    int saved = errno;
+                    close(fd);
+                    ::unlink(temporary.c_str());
+                    errno = saved;
+                    return false;
+                }
+                data += written;
+                left -= written;
+            }
+            if (close(fd) != 0 || rename(temporary.c_str(), path.c_str()) != 0) {
+                int saved = errno;
+                ::unlink(temporary.c_str());
+                errno = saved;
+                return false;
+            }
+            return true;
+        }
+
+        bool profile_read(const std::string& path, profile_header * header,
+            ps_tool_timer_data_t * timer_data,
+            ps_tool_counter_data_t * counter_data) {
+            memset(timer_data, 0, sizeof(ps_tool_timer_data_t));
+            memset(counter_data, 0, sizeof(ps_tool_counter_data_t));
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(profile_header)) {
+                close(fd);
+                return false;
+            }
+            size_t size = st.st_size;
+            void * memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (memory == MAP_FAILED) {
+                return false;
+            }
+            const char * begin = (const char *)memory;
+            memcpy(header, begin, sizeof(profile_header));
+            /* Check every size against the file before using it */
+            uint64_t values = (size - sizeof(profile_header)) / sizeof(double);
+            bool valid = memcmp(header->magic, "PSPROF", 7) == 0 &&
+                header->version == profile_version &&
+                header->byte_order == profile_byte_order &&
+                header->header_size == sizeof(profile_header) &&
+                header->strings_size % 8 == 0 &&
+                header->strings_size <= size - sizeof(profile_header) &&
+                fits(header->num_timers, header->num_threads, values) &&
+                fits((uint64_t)header->num_timers * header->num_threads,
+                    header->num_metrics, values) &&
+                fits(header->num_counters, header->num_threads, values);
+            uint64_t timer_values = 0;
+            uint64_t counter_values = 0;
+            if (valid) {
+                timer_values = (uint64_t)header->num_timers *
+                    header->num_threads * header->num_metrics;
+                counter_values = (uint64_t)header->num_counters *
+                    header->num_threads;
+                valid = header->strings_size + (timer_values +
+                    profile_counter_columns * counter_values) *
+                    sizeof(double) == size - sizeof(profile_header);
+            }
+            if (!valid) {
+                munmap(memory, size);
+                return false;
+            }
+
+            const char * s = begin + sizeof(profile_header);
+            const char * strings_end = s + header->strings_size;
+            timer_data->num_timers = header->num_timers;
+            timer_data->num_threads = header->num_threads;
+            timer_data->num_metrics = header->num_metrics;
+            timer_data->metric_names = (char **)calloc(header->num_metrics,
+                sizeof(char *));
+            timer_data->timer_names = (char **)calloc(header->num_timers,
+                sizeof(char *));
+            counter_data->num_counters = header->num_counters;
+            counter_data->num_threads = header->num_threads;
+            counter_data->counter_names = (char **)calloc(
+                header->num_counters, sizeof(char *));
+            for (uint32_t i = 0 ; valid && i < header->num_metrics ; i++) {
+                valid = next_string(s, strings_end,
+                    &timer_data->metric_names[i]);
+            }
+            for (uint32_t i = 0 ; valid && i < header->num_timers ; i++) {
+                valid = next_string(s, strings_end,
+                    &timer_data->timer_names[i]);
+            }
+            for (uint32_t i = 0 ; valid && i < header->num_counters ; i++) {
+                valid = next_string(s, strings_end,
+                    &counter_data->counter_names[i]);
+            }
+
+            const char * p = strings_end;
+            timer_data->values = (double *)calloc(timer_values,
+                sizeof(double));
+            if (timer_values > 0) {
+                memcpy(timer_data->values, p, timer_values * sizeof(double));
+            }
+            p += timer_values * sizeof(double);
+            double ** columns[profile_counter_columns] = {
+                &counter_data->num_samples, &counter_data->value_total,
+                &counter_data->value_min, &counter_data->value_max,
+                &counter_data->value_sumsqr};
+            for (uint32_t c = 0 ; c < profile_counter_columns ; c++) {
+                *columns[c] = (double *)calloc(counter_values,
+                    sizeof(double));
+                if (counter_values > 0) {
+                    memcpy(*columns[c], p, counter_values * sizeof(double));
+                }
+                p += counter_values * sizeof(double);
+            }
+            munmap(memory, size);
+            if (!valid) {
+                profile_free(timer_data, counter_data);
+            }
+            return valid;
+        }
+
+        void profile_free(ps_tool_timer_data_t * timer_data,
+            ps_tool_counter_data_t * counter_data) {
+            if (timer_data->metric_names != nullptr) {
+                for (unsigned int i = 0 ; i < timer_data->num_metrics ; i++) {
+                    free(timer_data->metric_names[i]);
+                }
+            }
+            if (timer_data->timer_names != nullptr) {
+                for (unsigned int i = 0 ; i < timer_data->num_timers ; i++) {
+                    free(timer_data->timer_names[i]);
+                }
+            }
+            if (counter_data->counter_names != nullptr) {
+                for (unsigned int i = 0 ; i < counter_data->num_counters ; i++) {
+                    free(counter_data->counter_names[i]);
+                }
+            }
+            free(timer_data->metric_names);
+            free(timer_data->timer_names);
+            free(timer_data->values);
+            free(counter_data->counter_names);
+            free(counter_data->num_samples);
+            free(counter_data->value_total);
+            free(counter_data->value_min);
+            free(counter_data->value_max);
+            free(counter_data->value_sumsqr);
+            memset(timer_data, 0, sizeof(ps_tool_timer_data_t));
+            memset(counter_data, 0, sizeof(ps_tool_counter_data_t));
+        }
+
+        std::string profile_default_name(uint64_t pid) {
+            return "perfstubs." + std::to_string(pid) + ".profile";
+        }
+    }
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include "perfstubs_api/tool.h"
+#include <cstdint>
+#include <string>
+
+/* The binary profile of the reference tool, written by ps_dump_data_ when
+ * PS_TOOL_PROFILE=binary.
+ *
+ * The file holds the same arrays as ps_tool_timer_data_t and
+ * ps_tool_counter_data_t, so the tool fills them once for a query or a
+ * dump, and a reader gets them back as they were returned by the tool:
+ *
+ *   profile_header
+ *   string table: num_metrics metric names, num_timers timer names and
+ *     num_counters counter names, each terminated by a NUL, padded with
+ *     NULs to strings_size (a multiple of 8) bytes
+ *   num_timers x num_threads x num_metrics doubles: the timer values,
+ *     by timer, then thread, then metric
+ *   num_counters x num_threads doubles, for each of num_samples,
+ *     value_total, value_min, value_max and value_sumsqr in turn
+ *
+ * Values are in the byte order of the writer, recorded in the header; a
+ * reader rejects a file written with the other order.  The layout changes
+ * only with the version number. */
+
+namespace external {
+    namespace ps_implementation {
+
+        static const uint32_t profile_version = 1;
+        static const uint32_t profile_byte_order = 0x01020304;
+        static const uint32_t profile_counter_columns = 5;
+
+        struct profile_header {
+            char magic[8]; /* "PSPROF" */
+            uint32_t version;
+            uint32_t byte_order;
+            uint32_t header_size;
+            uint32_t num_metrics;
+            uint32_t num_timers;
+            uint32_t num_threads;
+            uint32_t num_counters;
+            uint32_t reserved;
+            uint64_t pid;
+            uint64_t strings_size;
+        };
+
+        /* Write the profile to a file, with one write.  The file is
+         * written under a temporary name and renamed, so a reader never
+         * sees a partial profile.  Returns false, with errno set, on an
+         * error. */
+        bool profile_write(const std::string& path,
+            const ps_tool_timer_data_t& timer_data,
+            const ps_tool_counter_data_t& counter_data);
+
+        /* Read a profile into arrays allocated with calloc, to be released
+         * with profile_free.  Returns false if the file can't be mapped or
+         * is not a valid profile. */
+        bool profile_read(const std::string& path, profile_header * header,
+            ps_tool_timer_data_t * timer_data,
+            ps_tool_counter_data_t * counter_data);
+        void profile_free(ps_tool_timer_data_t * timer_data,
+            ps_tool_counter_data_t * counter_data);
+
+        /* The file name of the profile of a process */
+        std::string profile_default_name(uint64_t pid);
+    }
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#include "tool1_shm.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace external {
+    namespace ps_implementation {
+
+        namespace {
+            /* The size of a region, or 0 if it doesn't fit in a size_t */
+            size_t region_size(uint32_t max_timers, uint32_t max_threads) {
+                size_t slots = (size_t)max_timers * max_threads;
+                if (max_threads > 0 && (slots / max_threads != max_timers ||
+                    slots > SIZE_MAX / 2 / sizeof(shm_slot))) {
+                    return 0;
+                }
+                return sizeof(shm_header) + (size_t)max_timers *
+                    sizeof(shm_name) + slots * sizeof(shm_slot);
+            }
+
+            std::string region_path(const std::string& name) {
+                return "/dev/shm/" + name;
+            }
+        }
+
+        shm_region * shm_region::create(const std::string& name,
+            uint32_t max_timers, uint32_t max_threads) {
+            std::string path(region_path(name));
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                return nullptr;
+            }
+            size_t size = region_size(max_timers, max_threads);
+            if (ftruncate(fd, size) != 0) {
+                close(fd);
+                ::unlink(path.c_str());
+                return nullptr;
+            }
+            void * memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+            close(fd);
+            if (memory == MAP_FAILED) {
+                ::unlink(path.c_str());
+                return nullptr;
+            }
+            /* The file is zero filled, only the header needs setting.  The
+             * magic is written last, so a reader never sees a valid magic
+             * with an incomplete header. */
+            shm_header * header = (shm_header *)memory;
+            header->version = shm_version;
+            header->header_size = sizeof(shm_header);
+            header->name_size = sizeof(shm_name);
+            header->slot_size = sizeof(shm_slot);
+            header->max_timers = max_timers;
+            header->max_threads = max_threads;
+            header->pid = (uint64_t)getpid();
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(header->magic, "PSSHM", 6);
+            return new shm_region(path, header, size, -1);
+        }
+
+        shm_region * shm_region::attach(const std::string& name) {
+            std::string path(region_path(name));
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shm_header)) {
+                close(fd);
+                return nullptr;
+            }
+            void * memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                fd, 0);
+            if (memory == MAP_FAILED) {
+                close(fd);
+                return nullptr;
+            }
+            shm_header * header = (shm_header *)memory;
+            size_t size = region_size(header->max_timers, header->max_threads);
+            if (memcmp(header->magic, "PSSHM", 6) != 0 ||
+                header->version != shm_version ||
+                header->header_size != sizeof(shm_header) ||
+                header->name_size != sizeof(shm_name) ||
+                header->slot_size != sizeof(shm_slot) ||
+                size == 0 || (size_t)st.st_size < size) {
+                munmap(memory, st.st_size);
+                close(fd);
+                return nullptr;
+            }
+            return new shm_region(path, header, st.st_size, fd);
+        }
+
+        bool shm_region::check(void) {
+            if (_fd < 0) {
+                return true;
+            }
+            struct stat st;
+            return fstat(_fd, &st) == 0 &&
+                (size_t)st.st_size >= region_size(_max_timers, _max_threads) &&
+                _header->version == shm_version &&
+                _header->max_timers == _max_timers &&
+                _header->max_threads == _max_threads;
+        }
+
+        shm_region::~shm_region() {
+            munmap(_header, _size);
+            if (_fd >= 0) {
+                close(_fd);
+            }
+        }
+
+        void shm_region::unlink(void) {
+            ::unlink(_path.c_str());
+        }
+
+        std::string shm_default_name(uint64_t pid) {
+            return "perfstubs." + std::to_string(pid);
+        }
+    }
+}
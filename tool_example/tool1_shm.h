@@ -0,0 +1,171 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* The live profile of the reference tool, exported in shared memory.
+ *
+ * The region is a file under /dev/shm, mapped by the tool and by any
+ * number of readers (such as perfstubs-top).  Its layout is:
+ *
+ *   shm_header
+ *   max_timers x shm_name
+ *   max_timers x max_threads x shm_slot, by timer then thread
+ *
+ * A publisher thread in the tool is the only writer.  A timer's name is
+ * written before num_timers is increased to include it, and each slot is
+ * updated inside its own sequence lock: readers retry while the sequence
+ * is odd or changes while they copy the slot.  Readers never write to the
+ * region, so they don't need any system call after mapping it.
+ *
+ * The layout changes only with the version number. */
+
+namespace external {
+    namespace ps_implementation {
+
+        static const uint32_t shm_version = 1;
+        static const size_t shm_name_size = 128;
+
+        struct shm_header {
+            char magic[8]; /* "PSSHM" */
+            uint32_t version;
+            uint32_t header_size;
+            uint32_t name_size;
+            uint32_t slot_size;
+            uint32_t max_timers;
+            uint32_t max_threads;
+            uint64_t pid;
+            /* Published with release stores */
+            std::atomic<uint32_t> num_timers;
+            std::atomic<uint32_t> num_threads;
+            /* The number of times the publisher has updated the region,
+             * and the monotonic clock (in nanoseconds) of the last one */
+            std::atomic<uint64_t> updates;
+            std::atomic<uint64_t> update_time;
+        };
+
+        struct shm_name {
+            char name[shm_name_size];
+        };
+
+        /* The totals of one timer on one thread.  Times are in
+         * nanoseconds. */
+        struct shm_slot {
+            std::atomic<uint32_t> seq;
+            uint32_t timer;
+            std::atomic<uint64_t> calls;
+            std::atomic<uint64_t> inclusive;
+            std::atomic<uint64_t> exclusive;
+        };
+
+        static_assert(sizeof(shm_slot) == 32, "shm_slot must stay 32 bytes");
+
+        struct shm_values {
+            uint64_t calls;
+            uint64_t inclusive;
+            uint64_t exclusive;
+        };
+
+        class shm_region {
+            public:
+                /* Create the region /dev/shm/<name>, for the tool */
+                static shm_region * create(const std::string& name,
+                    uint32_t max_timers, uint32_t max_threads);
+                /* Map an existing region read only, for a reader */
+                static shm_region * attach(const std::string& name);
+                ~shm_region();
+                /* Remove the file, the mappings stay valid */
+                void unlink(void);
+
+                shm_header * header(void) { return _header; }
+                shm_name * names(void) {
+                    return (shm_name *)((char *)_header +
+                        _header->header_size);
+                }
+                shm_slot * slot(uint32_t timer, uint32_t thread) {
+                    shm_slot * slots = (shm_slot *)(names() + _max_timers);
+                    return &slots[(size_t)timer * _max_threads + thread];
+                }
+                /* The numbers of timers and threads published, never more
+                 * than the region was created for */
+                uint32_t num_timers(void) {
+                    uint32_t n = _header->num_timers.load(
+                        std::memory_order_acquire);
+                    return n < _max_timers ? n : _max_timers;
+                }
+                uint32_t num_threads(void) {
+                    uint32_t n = _header->num_threads.load(
+                        std::memory_order_acquire);
+                    return n < _max_threads ? n : _max_threads;
+                }
+                /* For a reader, whether the file still has the size and
+                 * layout it had when it was attached: reading a mapping
+                 * past the end of a file that was truncated faults */
+                bool check(void);
+                const std::string& path(void) const { return _path; }
+
+                /* Only called by the publisher */
+                void write(uint32_t timer, uint32_t thread,
+                    const shm_values& values) {
+                    shm_slot * s = slot(timer, thread);
+                    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+                    s->seq.store(seq + 1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+                    s->timer = timer;
+                    s->calls.store(values.calls, std::memory_order_relaxed);
+                    s->inclusive.store(values.inclusive,
+                        std::memory_order_relaxed);
+                    s->exclusive.store(values.exclusive,
+                        std::memory_order_relaxed);
+                    s->seq.store(seq + 2, std::memory_order_release);
+                }
+
+                /* Copy a slot, retrying while the publisher updates it.
+                 * Returns false if the slot stays inconsistent, as when
+                 * the publisher died during an update. */
+                static const int max_read_attempts = 100;
+                bool read(uint32_t timer, uint32_t thread,
+                    shm_values& values) {
+                    const shm_slot * s = slot(timer, thread);
+                    for (int attempt = 0 ; attempt < max_read_attempts ;
+                        attempt++) {
+                        uint32_t before = s->seq.load(std::memory_order_acquire);
+                        values.calls = s->calls.load(std::memory_order_relaxed);
+                        values.inclusive =
+                            s->inclusive.load(std::memory_order_relaxed);
+                        values.exclusive =
+                            s->exclusive.load(std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_acquire);
+                        if ((before & 1) == 0 && s->seq.load(
+                            std::memory_order_relaxed) == before) {
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+            private:
+                shm_region(const std::string& path, shm_header * header,
+                    size_t size, int fd) : _path(path), _header(header),
+                    _size(size), _fd(fd), _max_timers(header->max_timers),
+                    _max_threads(header->max_threads) {}
+                std::string _path;
+                shm_header * _header;
+                size_t _size;
+                /* The file, kept open by a reader to check its size */
+                int _fd;
+                /* The layout, as it was when the region was mapped */
+                const uint32_t _max_timers;
+                const uint32_t _max_threads;
+        };
+
+        /* The file name of the region of a process */
+        std::string shm_default_name(uint64_t pid);
+    }
+}
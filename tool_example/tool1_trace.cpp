@@ -0,0 +1,189 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#include "tool1_trace.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unistd.h>
+
+namespace external {
+    namespace ps_implementation {
+        std::atomic<bool> tracing{false};
+
+        namespace {
+            /* Guards the list of buffers and writer_done.  The file is
+             * only written by the writer thread, and by trace_finalize once
+             * the writer has stopped.  Buffers are never removed from the
+             * list. */
+            std::mutex trace_mutex;
+            std::condition_variable trace_cv;
+            std::vector<trace_buffer*> buffers;
+            /* Never destroyed, so that a program that exits without
+             * finalizing the tool isn't terminated by a joinable thread */
+            std::thread * writer{nullptr};
+            bool writer_done{false};
+            FILE * trace_file{nullptr};
+            size_t buffer_capacity{1 << 16};
+
+            void drain_all(const std::vector<trace_buffer*>& list) {
+                for (auto b : list) {
+                    b->drain(trace_file);
+                }
+            }
+
+            /* The buffers are copied under the lock and drained without
+             * it, so that registering a thread never waits for the disk */
+            void writer_loop(void) {
+                std::vector<trace_buffer*> list;
+                std::unique_lock<std::mutex> lock(trace_mutex);
+                while (!writer_done) {
+                    trace_cv.wait_for(lock, std::chrono::milliseconds(10));
+                    list = buffers;
+                    lock.unlock();
+                    drain_all(list);
+                    lock.lock();
+                }
+            }
+
+            void write_names(uint32_t type,
+                const std::vector<std::string>& names) {
+                trace_block_header block;
+                block.type = type;
+                block.thread = 0;
+                block.count = names.size();
+                fwrite(&block, sizeof(block), 1, trace_file);
+                for (size_t i = 0 ; i < names.size() ; i++) {
+                    uint32_t id_length[2] = { (uint32_t)i,
+                        (uint32_t)names[i].size() };
+                    fwrite(id_length, sizeof(id_length), 1, trace_file);
+                    fwrite(names[i].data(), 1, names[i].size(), trace_file);
+                }
+            }
+        }
+
+        trace_buffer::trace_buffer(uint32_t thread, size_t capacity) :
+            _thread(thread), _mask(capacity - 1),
+            _records(new trace_record[capacity]),
+            _head(0), _tail_cache(0), _dropped(0), _tail(0) {}
+
+        trace_buffer * trace_buffer::create(uint32_t thread,
+            size_t capacity) {
+            void * memory = nullptr;
+            if (posix_memalign(&memory, 64, sizeof(trace_buffer)) != 0) {
+                throw std::bad_alloc();
+            }
+            return new (memory) trace_buffer(thread, capacity);
+        }
+
+        trace_buffer::~trace_buffer() {
+            delete[] _records;
+        }
+
+        size_t trace_buffer::drain(FILE * file) {
+            uint64_t tail = _tail.load(std::memory_order_relaxed);
+            uint64_t head = _head.load(std::memory_order_acquire);
+            if (head == tail) {
+                return 0;
+            }
+            trace_block_header block;
+            block.type = TRACE_BLOCK_EVENTS;
+            block.thread = _thread;
+            block.count = head - tail;
+            fwrite(&block, sizeof(block), 1, file);
+            /* The live region may wrap around the end of the buffer */
+            size_t first = tail & _mask;
+            size_t count = std::min<size_t>(head - tail, _mask + 1 - first);
+            fwrite(&_records[first], sizeof(trace_record), count, file);
+            if (count < head - tail) {
+                fwrite(&_records[0], sizeof(trace_record),
+                    (head - tail) - count, file);
+            }
+            _tail.store(head, std::memory_order_release);
+            return head - tail;
+        }
+
+        void trace_initialize(void) {
+            const char * enable = getenv("PS_TOOL_TRACE");
+            if (enable == nullptr || atoi(enable) == 0) {
+                return;
+            }
+            const char * size = getenv("PS_TOOL_TRACE_BUFFER");
+            if (size != nullptr && atol(size) > 0) {
+                /* round up to a power of two */
+                buffer_capacity = 1;
+                while (buffer_capacity < (size_t)atol(size)) {
+                    buffer_capacity <<= 1;
+                }
+            }
+            std::string filename;
+            const char * name = getenv("PS_TOOL_TRACE_FILE");
+            if (name != nullptr) {
+                filename = name;
+            } else {
+                filename = "perfstubs." + std::to_string(getpid()) + ".trace";
+            }
+            trace_file = fopen(filename.c_str(), "wb");
+            if (trace_file == nullptr) {
+                std::cerr << "Tool: unable to open " << filename
+                          << ", tracing disabled" << std::endl;
+                return;
+            }
+            trace_file_header header;
+            memset(&header, 0, sizeof(header));
+            strncpy(header.magic, "PSTRACE", sizeof(header.magic));
+            header.version = 1;
+            header.record_size = sizeof(trace_record);
+            fwrite(&header, sizeof(header), 1, trace_file);
+            writer_done = false;
+            writer = new std::thread(writer_loop);
+            tracing.store(true, std::memory_order_relaxed);
+        }
+
+        trace_buffer * trace_register_thread(uint32_t thread) {
+            trace_buffer * b = trace_buffer::create(thread, buffer_capacity);
+            std::lock_guard<std::mutex> guard(trace_mutex);
+            buffers.push_back(b);
+            return b;
+        }
+
+        void trace_finalize(const std::vector<std::string>& timer_names,
+            const std::vector<std::string>& counter_names,
+            const std::vector<std::string>& phase_names) {
+            if (!tracing.load(std::memory_order_relaxed)) {
+                return;
+            }
+            tracing.store(false, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> guard(trace_mutex);
+                writer_done = true;
+            }
+            trace_cv.notify_one();
+            writer->join();
+            delete writer;
+            writer = nullptr;
+            std::lock_guard<std::mutex> guard(trace_mutex);
+            drain_all(buffers);
+            write_names(TRACE_BLOCK_TIMER_NAMES, timer_names);
+            write_names(TRACE_BLOCK_COUNTER_NAMES, counter_names);
+            write_names(TRACE_BLOCK_PHASE_NAMES, phase_names);
+            fclose(trace_file);
+            trace_file = nullptr;
+            uint64_t dropped = 0;
+            for (auto b : buffers) {
+                dropped += b->dropped();
+            }
+            if (dropped > 0) {
+                std::cerr << "Tool: " << dropped << " trace events were "
+                          << "dropped, increase PS_TOOL_TRACE_BUFFER" << std::endl;
+            }
+        }
+    }
+}
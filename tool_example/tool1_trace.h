@@ -0,0 +1,136 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* Event tracing for the reference tool.
+ *
+ * Each thread appends fixed size records to its own single-producer,
+ * single-consumer ring buffer.  A background writer thread drains the
+ * buffers to a binary file.  If a buffer is full, the event is dropped
+ * (and counted) rather than blocking the application thread.
+ *
+ * The trace file is a sequence of blocks after the file header:
+ *
+ *   trace_file_header
+ *   trace_block_header (type TRACE_BLOCK_EVENTS), count x trace_record
+ *   ...
+ *   trace_block_header (type TRACE_BLOCK_TIMER_NAMES,
+ *   TRACE_BLOCK_COUNTER_NAMES or TRACE_BLOCK_PHASE_NAMES), count x
+ *   (uint32_t id, uint32_t length, length x char)
+ *
+ * Event blocks for one thread are written in order, but blocks for
+ * different threads are interleaved.  Name blocks are written at the
+ * end of the trace, when the tool is finalized.
+ */
+
+namespace external {
+    namespace ps_implementation {
+
+        enum trace_event_kind : uint32_t {
+            TRACE_TIMER_START = 1,
+            TRACE_TIMER_STOP = 2,
+            TRACE_COUNTER_SAMPLE = 3,
+            /* The id is a phase id, and the value the iteration index */
+            TRACE_PHASE_START = 4,
+            TRACE_PHASE_STOP = 5
+        };
+
+        enum trace_block_type : uint32_t {
+            TRACE_BLOCK_EVENTS = 1,
+            TRACE_BLOCK_TIMER_NAMES = 2,
+            TRACE_BLOCK_COUNTER_NAMES = 3,
+            TRACE_BLOCK_PHASE_NAMES = 4
+        };
+
+        struct trace_file_header {
+            char magic[8]; /* "PSTRACE" */
+            uint32_t version;
+            uint32_t record_size;
+        };
+
+        struct trace_block_header {
+            uint32_t type;
+            uint32_t thread;
+            uint64_t count;
+        };
+
+        /* One event.  The timestamp is in nanoseconds from the monotonic
+         * clock, the id is a timer or counter id, and the value is only
+         * used by counter samples. */
+        struct trace_record {
+            uint64_t timestamp;
+            uint32_t id;
+            uint32_t kind;
+            double value;
+        };
+
+        class trace_buffer {
+            public:
+                /* Buffers are allocated on a cache line, so that the
+                 * alignment of the two sides holds without C++17 aligned
+                 * new */
+                static trace_buffer * create(uint32_t thread,
+                    size_t capacity);
+                trace_buffer(uint32_t thread, size_t capacity);
+                ~trace_buffer();
+                /* Only called by the owning thread */
+                inline void push(uint32_t kind, uint32_t id,
+                    uint64_t timestamp, double value = 0.0) {
+                    uint64_t head = _head.load(std::memory_order_relaxed);
+                    if (head - _tail_cache > _mask) {
+                        _tail_cache = _tail.load(std::memory_order_acquire);
+                        if (head - _tail_cache > _mask) {
+                            _dropped.store(_dropped.load(
+                                std::memory_order_relaxed) + 1,
+                                std::memory_order_relaxed);
+                            return;
+                        }
+                    }
+                    trace_record& r = _records[head & _mask];
+                    r.timestamp = timestamp;
+                    r.id = id;
+                    r.kind = kind;
+                    r.value = value;
+                    _head.store(head + 1, std::memory_order_release);
+                }
+                /* Only called by the writer thread */
+                size_t drain(FILE * file);
+                uint64_t dropped(void) const {
+                    return _dropped.load(std::memory_order_relaxed);
+                }
+            private:
+                /* read by both sides, never written */
+                uint32_t _thread;
+                uint64_t _mask;
+                trace_record * _records;
+                /* producer side */
+                alignas(64) std::atomic<uint64_t> _head;
+                uint64_t _tail_cache;
+                std::atomic<uint64_t> _dropped;
+                /* consumer side */
+                alignas(64) std::atomic<uint64_t> _tail;
+        };
+
+        /* Set when tracing is enabled with PS_TOOL_TRACE, and cleared by
+         * trace_finalize while other threads may be checking it */
+        extern std::atomic<bool> tracing;
+
+        /* Read the environment and start the writer thread, if tracing is
+         * enabled.  The file name is taken from PS_TOOL_TRACE_FILE, and the
+         * buffer size (in events per thread) from PS_TOOL_TRACE_BUFFER. */
+        void trace_initialize(void);
+        trace_buffer * trace_register_thread(uint32_t thread);
+        /* Stop the writer, flush the buffers and write the name tables */
+        void trace_finalize(const std::vector<std::string>& timer_names,
+            const std::vector<std::string>& counter_names,
+            const std::vector<std::string>& phase_names);
+    }
+}
@@ -0,0 +1,120 @@
+// Copyright (c) 2019-2022 University of Oregon
+// Distributed under the BSD Software License
+// (See accompanying file LICENSE.txt)
+
+/* A second, minimal tool that only counts timer starts and stops.  Unlike
+ * tool one, it doesn't export any ps_tool_* symbols: it is only found by
+ * registering itself with ps_register_tool(), so it can be linked into the
+ * same executable as another tool. */
+
+#include "perfstubs_api/tool.h"
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+using namespace std;
+
+namespace external {
+    namespace ps_implementation2 {
+        std::mutex my_mutex;
+
+        class profiler {
+            public:
+                profiler(const std::string& name) : _name(name),
+                    _starts(0), _stops(0) {}
+                std::string _name;
+                std::atomic<uint64_t> _starts;
+                std::atomic<uint64_t> _stops;
+        };
+
+        std::unordered_map<std::string, profiler*> profilers;
+        std::vector<profiler*> profiler_list;
+
+        void * find_timer(const char * timer_name) {
+            std::string name(timer_name);
+            std::lock_guard<std::mutex> guard(my_mutex);
+            auto iter = profilers.find(name);
+            if (iter == profilers.end()) {
+                profiler * p = new profiler(name);
+                profilers.insert(std::pair<std::string,profiler*>(name,p));
+                profiler_list.push_back(p);
+                return (void*)p;
+            }
+            return (void*)iter->second;
+        }
+
+        void initialize(void) { }
+
+        void dump_data(void) {
+            std::lock_guard<std::mutex> guard(my_mutex);
+            for (auto p : profiler_list) {
+                cout << "Tool2: " << p->_starts << " starts, "
+                     << p->_stops << " stops  " << p->_name << endl;
+            }
+        }
+
+        void * timer_create(const char * timer_name) {
+            return find_timer(timer_name);
+        }
+
+        void timer_start(void * timer) {
+            profiler * p = (profiler *) timer;
+            if (p != nullptr) {
+                p->_starts.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void timer_stop(void * timer) {
+            profiler * p = (profiler *) timer;
+            if (p != nullptr) {
+                p->_stops.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void start_string(const char * timer_name) {
+            timer_start(find_timer(timer_name));
+        }
+
+        void stop_string(const char * timer_name) {
+            timer_stop(find_timer(timer_name));
+        }
+    }
+}
+
+namespace MINE = external::ps_implementation2;
+
+static void __attribute__((constructor)) initme2(void);
+static void __attribute__((destructor)) finime2(void);
+
+static int tool_id;
+
+static void initme2(void) {
+    ps_plugin_data_t data;
+    ps_register_t reg_function;
+    reg_function = &ps_register_tool;
+    if (reg_function != NULL) {
+        memset(&data, 0, sizeof(ps_plugin_data_t));
+        data.tool_name = strdup("tool two");
+        data.initialize = &MINE::initialize;
+        data.dump_data = &MINE::dump_data;
+        data.start_string = &MINE::start_string;
+        data.stop_string = &MINE::stop_string;
+        data.timer_create = &MINE::timer_create;
+        data.timer_start = &MINE::timer_start;
+        data.timer_stop = &MINE::timer_stop;
+        tool_id = reg_function(&data);
+    }
+}
+
+static void finime2(void) {
+    ps_deregister_t dereg_function;
+    dereg_function = &ps_deregister_tool;
+    if (dereg_function != NULL) {
+        dereg_function(tool_id);
+    }
+}